@@ -0,0 +1,305 @@
+#define DANBING_TK_NO_MAIN
+#include "../src/aQueryFasta_thread.cpp"
+
+#include <random>
+
+/*
+Microbenchmarks for the align hot kernels.
+
+Read pairs are simulated from haplotype sequences (e.g. test/QC/input/HG002.0.fa) with a fixed
+seed, so every run sees the same fixtures. Each kernel is run over all fixtures it applies to,
+repeatedly until at least [-t] sec have passed, and reported as ns per call and reads per sec.
+Inputs of a kernel are produced by the kernels before it, the same way danbing-tk chains them.
+*/
+
+struct bench_pair_t {
+	string seq1, seq2;
+	vector<uint64_t> kmers1, kmers2;       // canonical
+	vector<uint64_t> noncakmers1, noncakmers2;
+	vector<kmerIndex_uint32_umap::iterator> its1, its2;
+	bool subPass = false, kfPass = false;
+	int rm1 = 0, rm2 = 0;
+	uint64_t destLocus;
+};
+
+double minSec = 1;
+
+// f runs one pass over the fixtures and returns the number of reads it processed
+template <typename F>
+void runBench(const char* name, uint64_t nop, F f) {
+	if (nop == 0) {
+		cout << name << "\t0\tNA\tNA\n";
+		return;
+	}
+	uint64_t nread = f(); // warm up
+	uint64_t npass = 0;
+	double sec;
+	auto t0 = std::chrono::steady_clock::now();
+	do {
+		f();
+		++npass;
+		sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	} while (sec < minSec);
+	cout << name << '\t' << nop * npass << '\t' << sec * 1e9 / (nop * npass) << '\t' << nread * npass / sec << '\n';
+}
+
+void readFasta(string fname, vector<string>& ctgs) {
+	ifstream fin(fname);
+	assert(fin);
+	string line;
+	while (getline(fin, line)) {
+		if (line.empty()) { continue; }
+		if (line[0] == '>') { ctgs.emplace_back(); }
+		else {
+			assert(ctgs.size());
+			ctgs.back() += line;
+		}
+	}
+	fin.close();
+}
+
+// fragments are sampled uniformly over all bases; substitutions are added at rate `err`
+void simulatePairs(vector<string>& ctgs, uint64_t npair, uint64_t flen, uint64_t rlen, double err, uint64_t seed, vector<bench_pair_t>& pairs) {
+	std::mt19937_64 gen(seed);
+	vector<double> w;
+	for (string& c : ctgs) {
+		for (char& ch : c) { ch = toupper(ch); }
+		w.push_back(c.size() >= flen ? c.size() - flen + 1 : 0);
+	}
+	std::discrete_distribution<uint64_t> pickCtg(w.begin(), w.end());
+	std::uniform_real_distribution<double> u01(0, 1);
+	std::uniform_int_distribution<int> pickAlt(1, 3);
+	auto mutate = [&](string& s) {
+		for (char& ch : s) {
+			if (u01(gen) >= err) { continue; }
+			auto it = std::find(alphabet, alphabet+4, ch);
+			if (it == alphabet+4) { continue; }
+			ch = alphabet[((it - alphabet) + pickAlt(gen)) % 4];
+		}
+	};
+	pairs.resize(npair);
+	for (bench_pair_t& p : pairs) {
+		string& c = ctgs[pickCtg(gen)];
+		uint64_t beg = std::uniform_int_distribution<uint64_t>(0, c.size() - flen)(gen);
+		p.seq1 = c.substr(beg, rlen);
+		p.seq2 = getRC(c.substr(beg + flen - rlen, rlen));
+		mutate(p.seq1);
+		mutate(p.seq2);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		cerr << '\n'
+		     << "Usage: align_bench [-n] [-seed] [-e] [-cth] [-gc] [-t] [-hp] -qs -fa\n"
+		     << "Options:\n"
+		     << "  -qs <STR>        Prefix of the index, e.g. test/QC/input/pan\n"
+		     << "  -fa <STR>        Haplotype sequences to simulate read pairs from, e.g. test/QC/input/HG002.0.fa\n"
+		     << "  -n <INT>         Number of read pairs to simulate. [20000]\n"
+		     << "  -seed <INT>      Seed of the read simulator. [1]\n"
+		     << "  -e <FLOAT>       Substitution rate of simulated reads. [0.002]\n"
+		     << "  -cth <INT>       Same as danbing-tk -cth. [10]\n"
+		     << "  -gc <INT>        Same as danbing-tk -gc. [50]\n"
+		     << "  -t <FLOAT>       Minimal time in sec spent on each kernel. [1]\n"
+		     << "  -hp              Same as danbing-tk -hp thp, to compare against a run without it.\n"
+		     << "Writes kernel, calls, ns/op and reads/s to STDOUT as tsv.\n\n";
+		return 0;
+	}
+
+	vector<string> args(argv, argv+argc);
+	string trPrefix, faFname;
+	uint64_t npair = 20000, seed = 1, Cthreshold = 10, thread_cth = 50;
+	double err = 0.002;
+	bool hugepages = false;
+	for (int argi = 1; argi < argc; ++argi) {
+		if (args[argi] == "-qs") { trPrefix = args[++argi]; }
+		else if (args[argi] == "-fa") { faFname = args[++argi]; }
+		else if (args[argi] == "-n") { npair = stoul(args[++argi]); }
+		else if (args[argi] == "-seed") { seed = stoul(args[++argi]); }
+		else if (args[argi] == "-e") { err = stod(args[++argi]); }
+		else if (args[argi] == "-cth") { Cthreshold = stoi(args[++argi]); }
+		else if (args[argi] == "-gc") { thread_cth = stoi(args[++argi]); }
+		else if (args[argi] == "-t") { minSec = stod(args[++argi]); }
+		else if (args[argi] == "-hp") { hugepages = true; }
+		else {
+			cerr << "invalid option: " << args[argi] << endl;
+			return 1;
+		}
+	}
+	assert(trPrefix.size() and faFname.size());
+
+	string trFname = trPrefix + ".tr.kmers";
+	string trTab = findKmerTable(trFname);
+	uint64_t nloci = trTab.size() ? kmertab_t(trTab).h.nloci : countLoci(trFname);
+	vector<kmer_aCount_umap> trKmerDB(nloci);
+	vector<GraphType> graphDB(nloci);
+	kmerIndex_uint32_umap kmerDBi;
+	vector<uint32_t> kmerDBi_vv;
+	readBinaryIndex(kmerDBi, kmerDBi_vv, trPrefix);
+	readBinaryGraph(graphDB, trPrefix);
+	if (trTab.size()) { readKmerTable(trKmerDB, trTab); }
+	else { readKmers(trKmerDB, trFname); }
+	if (hugepages) {
+		uint64_t n = adviseHugepages();
+		cerr << "-hp: " << fmtBytes(n) << " advised, " << fmtBytes(smapsRollupBytes("AnonHugePages:")) << " in huge pages" << endl;
+	}
+
+	vector<string> ctgs;
+	readFasta(faFname, ctgs);
+	vector<bench_pair_t> pairs;
+	simulatePairs(ctgs, npair, 500, 150, err, seed, pairs);
+
+	// build fixtures for each stage by running the stages before it once
+	uint64_t nhash = 0, nsub = 0, nkf = 0, nasgn = 0, nkmers = 0;
+	vector<uint32_t> hits1(nloci), hits2(nloci);
+	for (bench_pair_t& p : pairs) {
+		read2kmers(p.kmers1, p.seq1, ksize);
+		read2kmers(p.kmers2, p.seq2, ksize);
+		read2kmers(p.noncakmers1, p.seq1, ksize, 0, 0, false, true);
+		read2kmers(p.noncakmers2, p.seq2, ksize, 0, 0, false, true);
+		nkmers += p.kmers1.size() + p.kmers2.size();
+		p.destLocus = nloci;
+		if (not p.kmers1.size() or not p.kmers2.size()) { continue; }
+		p.subPass = not subfilter(p.kmers1, p.kmers2, kmerDBi, nhash);
+		if (not p.subPass) { continue; }
+		++nsub;
+		int kf1 = 0, kf2 = 0;
+		kfilter(p.kmers1, p.kmers2, p.its1, p.its2, kmerDBi, Cthreshold, nhash, kf1, kf2, p.rm1, p.rm2);
+		p.kfPass = not (p.rm1 and p.rm2);
+		if (not p.kfPass) { continue; }
+		++nkf;
+		vector<PE_KMC> dup;
+		log_t log;
+		uint64_t tri0;
+		int nm1, nm2, hf1 = 0, hf2 = 0, rm1 = p.rm1, rm2 = p.rm2;
+		p.destLocus = countHit(kmerDBi_vv, p.its1, p.its2, hits1, hits2, dup, nloci, Cthreshold, log, tri0, nm1, nm2, hf1, hf2, rm1, rm2);
+		nasgn += p.destLocus != nloci;
+	}
+	cerr << nloci << " loci, " << kmerDBi.size() << " indexed kmers" << endl
+	     << pairs.size() << " pairs simulated from " << ctgs.size() << " sequences with seed " << seed << endl
+	     << nsub << " pairs passed subfilter, " << nkf << " passed kfilter, " << nasgn << " assigned to a locus" << endl;
+
+	uint64_t nsubOp = 0, nkfOp = 0;
+	for (bench_pair_t& p : pairs) {
+		nsubOp += p.kmers1.size() and p.kmers2.size();
+		nkfOp += p.subPass;
+	}
+	volatile uint64_t sink = 0;
+
+	cout << "kernel\tcalls\tns/op\treads/s\n";
+	runBench("read2kmers", 2*pairs.size(), [&]() {
+		vector<uint64_t> kmers;
+		for (bench_pair_t& p : pairs) {
+			kmers.clear();
+			read2kmers(kmers, p.seq1, ksize);
+			kmers.clear();
+			read2kmers(kmers, p.seq2, ksize);
+		}
+		sink += kmers.size();
+		return 2*pairs.size();
+	});
+	runBench("getNuRC", nkmers, [&]() {
+		uint64_t s = 0;
+		for (bench_pair_t& p : pairs) {
+			for (uint64_t km : p.kmers1) { s += getNuRC(km, ksize); }
+			for (uint64_t km : p.kmers2) { s += getNuRC(km, ksize); }
+		}
+		sink += s;
+		return 2*pairs.size();
+	});
+	runBench("toCaKmer", nkmers, [&]() {
+		uint64_t s = 0;
+		for (bench_pair_t& p : pairs) {
+			for (uint64_t km : p.kmers1) { s += toCaKmer(km, ksize); }
+			for (uint64_t km : p.kmers2) { s += toCaKmer(km, ksize); }
+		}
+		sink += s;
+		return 2*pairs.size();
+	});
+	runBench("subfilter", nsubOp, [&]() {
+		uint64_t n = 0, nh = 0;
+		for (bench_pair_t& p : pairs) {
+			if (not p.kmers1.size() or not p.kmers2.size()) { continue; }
+			sink += subfilter(p.kmers1, p.kmers2, kmerDBi, nh);
+			n += 2;
+		}
+		return n;
+	});
+	runBench("kfilter", nkfOp, [&]() {
+		uint64_t n = 0, nh = 0;
+		vector<kmerIndex_uint32_umap::iterator> its1, its2;
+		for (bench_pair_t& p : pairs) {
+			if (not p.subPass) { continue; }
+			its1.clear();
+			its2.clear();
+			int kf1 = 0, kf2 = 0, rm1 = 0, rm2 = 0;
+			kfilter(p.kmers1, p.kmers2, its1, its2, kmerDBi, Cthreshold, nh, kf1, kf2, rm1, rm2);
+			n += 2;
+		}
+		sink += nh;
+		return n;
+	});
+	runBench("countHit", nkf, [&]() {
+		uint64_t n = 0;
+		vector<PE_KMC> dup;
+		log_t log;
+		for (bench_pair_t& p : pairs) {
+			if (not p.kfPass) { continue; }
+			dup.clear();
+			uint64_t tri0;
+			int nm1, nm2, hf1 = 0, hf2 = 0, rm1 = p.rm1, rm2 = p.rm2;
+			sink += countHit(kmerDBi_vv, p.its1, p.its2, hits1, hits2, dup, nloci, Cthreshold, log, tri0, nm1, nm2, hf1, hf2, rm1, rm2);
+			n += 2;
+		}
+		return n;
+	});
+	for (int correction = 0; correction < 2; ++correction) {
+		runBench(correction ? "isThreadFeasible+corr" : "isThreadFeasible", 2*nasgn, [&]() {
+			uint64_t n = 0;
+			log_t log;
+			for (bench_pair_t& p : pairs) {
+				if (p.destLocus == nloci) { continue; }
+				GraphType& g = graphDB[p.destLocus];
+				kmer_aCount_umap& trKmers = trKmerDB[p.destLocus];
+				vector<uint64_t> noncakmers, akmers;
+				sam_t sam;
+				sam.init1(p.seq1);
+				sink += isThreadFeasible(g, p.seq1, noncakmers, akmers, thread_cth, correction, sam.r1, trKmers, log);
+				noncakmers.clear();
+				sam.init2(p.seq2);
+				sink += isThreadFeasible(g, p.seq2, noncakmers, akmers, thread_cth, correction, sam.r2, trKmers, log);
+				n += 2;
+			}
+			return n;
+		});
+	}
+	runBench("assignTRkmc", 2*nasgn, [&]() {
+		uint64_t n = 0;
+		for (bench_pair_t& p : pairs) {
+			if (p.destLocus == nloci) { continue; }
+			GraphType& g = graphDB[p.destLocus];
+			kmer_aCount_umap& trKmers = trKmerDB[p.destLocus];
+			km_asgn_read_t r1, r2;
+			int af1 = 0, af2 = 0, rm1 = 0, rm2 = 0;
+			assignTRkmc(p.kmers1, trKmers, g, r1, af1, rm1);
+			assignTRkmc(p.kmers2, trKmers, g, r2, af2, rm2);
+			sink += r1.ei + r2.ei;
+			n += 2;
+		}
+		return n;
+	});
+	runBench("countNovelEdges", 2*nasgn, [&]() {
+		uint64_t n = 0;
+		kmerCount_umap bu;
+		for (bench_pair_t& p : pairs) {
+			if (p.destLocus == nloci) { continue; }
+			GraphType& g = graphDB[p.destLocus];
+			countNovelEdges(p.noncakmers1, g, bu);
+			countNovelEdges(p.noncakmers2, g, bu);
+			n += 2;
+		}
+		sink += bu.size();
+		return n;
+	});
+	return 0;
+}
@@ -0,0 +1,77 @@
+#!/usr/bin/env bash
+# End-to-end throughput of danbing-tk align at 1, 2, 4, ... N threads on a fixed-seed
+# simulated dataset. Reports reads/s, peak RSS, load time and speedup over 1 thread,
+# and checks that .tr.kmers is identical across thread counts (exit 1 otherwise).
+# Also exits 1 if no read passes threading or all counts are 0, i.e. the reads do not match the RPGG.
+#
+# usage: bench/align_e2e.sh [-n MAX_THREADS] [-c COVERAGE] [-s SEED] [-o OUT_DIR] [-i "FASTA ..."] [-q RPGG_PREFIX] [-a "ALIGN_OPTIONS"]
+#   defaults: -n $(nproc) -c 500 -s 1 -o bench_out -i "test/QC/input/HG002.0.fa test/QC/input/HG002.1.fa"
+#             -q test/QC/input/pan (built from HG002 and hs1) -a "-gc 50 3 -ae -kf 4 1 -cth 10 -k 21"
+set -eu
+
+cd "$(dirname "$0")/.."
+maxp=$(nproc)
+cov=500
+seed=1
+od=bench_out
+fas="test/QC/input/HG002.0.fa test/QC/input/HG002.1.fa"
+opts="-gc 50 3 -ae -kf 4 1 -cth 10 -k 21"
+rpgg=test/QC/input/pan
+while getopts "n:c:s:o:i:q:a:" opt; do
+	case $opt in
+		n) maxp=$OPTARG ;;
+		c) cov=$OPTARG ;;
+		s) seed=$OPTARG ;;
+		o) od=$OPTARG ;;
+		i) fas=$OPTARG ;;
+		q) rpgg=$OPTARG ;;
+		a) opts=$OPTARG ;;
+		*) sed -n 7,9p "$0"; exit 1 ;;
+	esac
+done
+
+make bin/danbing-tk bin/sim_reads
+mkdir -p $od
+
+# fixed-seed paired-end reads, interleaved
+reads=$od/reads.fa
+: >$reads
+for fa in $fas; do
+	pref=$od/$(basename $fa .fa)
+	bin/sim_reads -pe -no-err -uni -seed $seed -c $cov -ml 0 -o $pref -i $fa 2>/dev/null
+	cat $pref.allctgs.reads.fa >>$reads
+	rm $pref.allctgs.reads.fa
+done
+echo "$(( $(wc -l <$reads) / 2 )) reads simulated with seed $seed" >&2
+
+ps=""
+for (( p = 1; p < maxp; p *= 2 )); do ps="$ps $p"; done
+ps="$ps $maxp"
+
+status=0
+base=""
+echo -e "threads\treads\treads_per_sec\tquery_sec\tload_sec\twall_sec\tpeak_rss_kb\tspeedup" | tee $od/summary.tsv
+for p in $ps; do
+	t0=$(date +%s.%N)
+	bin/danbing-tk $opts -qs $rpgg -fa $reads -p $p -o $od/p$p >/dev/null 2>$od/p$p.log
+	t1=$(date +%s.%N)
+	nread=$(grep "reads processed in total" $od/p$p.log | awk '{print $1}')
+	query=$(grep "parallel query completed in" $od/p$p.log | awk '{print $(NF-1)}')
+	load=$(grep "^deserialized .* sec\.$" $od/p$p.log | awk '{print $(NF-1)}')
+	rss=$(grep "^peak RSS:" $od/p$p.log | awk '{print $3}')
+	[[ -z $base ]] && base=$query
+	awk -v p=$p -v n=$nread -v q=$query -v l=$load -v t0=$t0 -v t1=$t1 -v r=$rss -v b=$base \
+		'BEGIN { printf "%d\t%d\t%.0f\t%.3f\t%.3f\t%.3f\t%d\t%.2f\n", p, n, n/q, q, l, t1-t0, r, b/q }' | tee -a $od/summary.tsv
+
+	nthreaded=$(grep "reads passsed threading" $od/p$p.log | awk '{print $1}')
+	if [[ ${nthreaded:-0} == 0 ]] || ! awk '$1 > 0 { found = 1; exit } END { exit !found }' $od/p$p.tr.kmers; then
+		echo "ERROR: no read passed threading or all counts are 0 in $od/p$p; do the reads match $rpgg?" >&2
+		status=1
+	fi
+	if [[ $p != 1 ]] && ! cmp -s $od/p1.tr.kmers $od/p$p.tr.kmers; then
+		echo "ERROR: $od/p$p.tr.kmers differs from $od/p1.tr.kmers" >&2
+		status=1
+	fi
+done
+[[ $status == 0 ]] && echo ".tr.kmers nonzero and identical across thread counts:$ps" >&2
+exit $status
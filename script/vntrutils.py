@@ -124,14 +124,44 @@ def readKmerDict(fname, kmerDB=None, threshold=0, checkkmer=False):
     if not hasInput: return kmerDB
 
 
+KMERBIN_MAGIC = b"DTKKMB1\0"
+
+
+def readKmerBinary(fin):
+    """
+    Memory-map a binary .tr.kmers written with danbing-tk -kb (see src/kmerbin.h).
+    Returns header dict, locus offsets and counts (numpy arrays).
+    """
+    header = np.fromfile(fin, dtype=np.dtype([("magic", "S8"), ("rpgg_id", "<u8"), ("k", "<u4"), ("width", "<u4"), ("nloci", "<u8"), ("nkmers", "<u8")]), count=1)[0]
+    assert header["magic"] == KMERBIN_MAGIC.rstrip(b"\0"), "{} is not a binary .tr.kmers file".format(fin)
+    nloci, nkmers = int(header["nloci"]), int(header["nkmers"])
+    offsets = np.memmap(fin, dtype="<u8", mode="r", offset=40, shape=(nloci+1,))
+    counts = np.memmap(fin, dtype="<u{}".format(int(header["width"])), mode="r", offset=40+8*(nloci+1), shape=(nkmers,))
+    return header, offsets, counts
+
+
+def isKmerBinary(fin):
+    with open(fin, "rb") as f:
+        return f.read(8) == KMERBIN_MAGIC
+
+
 def readKms(fin, ki_tr, out=None):
     """
     Read kmers and compute sum for each locus.
     Use out=ARRAY to change ARRAY inplace.
     REQUIRE ki_tr since danbing-tk v1.3 since .kmers file does not contain locus info.
         Use ki_tr=None for backward compatibility.
+    Binary .tr.kmers (danbing-tk -kb) carry their own locus offsets; ki_tr is ignored.
     """
     ndb = out is None
+    if isKmerBinary(fin):
+        _, offsets, counts = readKmerBinary(fin)
+        cs = np.concatenate([np.zeros(1, dtype=np.uint64), np.cumsum(counts, dtype=np.uint64)])
+        kms = (cs[offsets[1:]] - cs[offsets[:-1]]).tolist()
+        if ndb:
+            return kms
+        out[:] = kms
+        return
     if out is None:
         out = []
     with open(fin) as f:
@@ -1,4 +1,13 @@
 #include "aQueryFasta_thread.h"
+#include "taskpool.h"
+#include "outwriter.h"
+#include "metrics.h"
+#include "alnbin.h"
+#include "checkpoint.h"
+#include "jobserver.h"
+#include "readbin.h"
+#include "memreport.h"
+#include "placement.h"
 //#include "/project/mchaisso_100/cmb-16/tsungyul/src/gperftools-2.9.1/src/gperftools/profiler.h"
 
 #include <cstdlib>
@@ -8,21 +17,21 @@
 #include <sstream>
 //#include <fstream>
 #include <numeric>
-#include <pthread.h>
-#include <semaphore.h>
-#include <fcntl.h>
-#include <errno.h>
 #include <ctime>
 #include <cassert>
 #include <cstring>
 #include <algorithm>
 #include <atomic>
+#include <map>
+#include <mutex>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <sys/stat.h>
+#include <sys/resource.h>
 
 using namespace std;
 
-sem_t *semreader;
-sem_t *semcount;
-sem_t *semwriter;
 bool testmode;
 uint64_t ksize = 21;
 uint64_t qth = 20;
@@ -41,7 +50,6 @@ typedef unordered_map<uint64_t, uint64_t> msa_umap; // dest_locus, counts
 // src_locus -> {dest_locus -> [src_count, dest_count_uncorrected, dest_count_corrected]}
 typedef unordered_map<uint64_t, unordered_map<uint64_t, std::tuple<uint64_t,uint64_t,uint64_t>>> err_umap;
 typedef std::pair<uint8_t, uint8_t> PE_KMC; // pair-end kmer count // XXX not compatible with reads longer than 255 bp
-typedef unordered_map<uint64_t, kmerCount_umap> bubbles_t;
 
 
 struct edit_t {
@@ -152,18 +160,106 @@ struct log_t {
 	}
 };
 
+inline uint64_t fmix64(uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
 
-void rand_str(char *dest, int length) {
-	char charset[] = "0123456789"
-	                 "abcdefghijklmnopqrstuvwxyz"
-					 "ABCDEFGHIJKLMNOPQRSTUVWXYZ";		
-	while (length-- > 0) {
-		uint64_t index = (double) rand() / RAND_MAX * (sizeof charset - 1);
-		*dest++ = charset[index];
+// 128-bit fingerprint of a sequence; (h1, h2) is the running state so a read pair can be chained
+void hash128(const string& s, uint64_t& h1, uint64_t& h2) {
+	static const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+	const char* p = s.data();
+	uint64_t n = s.size(), nb = n / 8, k;
+	for (uint64_t i = 0; i < nb; ++i) {
+		memcpy(&k, p + 8*i, 8);
+		h1 ^= fmix64(k * c1); h1 = ((h1 << 27) | (h1 >> 37)) * 5 + 0x52dce729;
+		h2 ^= fmix64(k * c2); h2 = ((h2 << 31) | (h2 >> 33)) * 5 + 0x38495ab5;
 	}
-	*dest = '\0';
+	k = 0;
+	memcpy(&k, p + 8*nb, n - 8*nb);
+	h1 ^= fmix64((k ^ n) * c1);
+	h2 ^= fmix64((k + n) * c2);
+	h1 += h2;
+	h2 += h1;
 }
 
+/*
+Cached outcome of a read pair, keyed by the 128-bit fingerprint of (seq, seq1).
+stage: how far the pair went before it was removed
+	DUP_SHORT: no valid kmers in either end
+	DUP_SUB:   removed by subfilter
+	DUP_KF:    removed by kfilter or countHit
+	DUP_ASGN:  assigned to destLocus; alned0/alned1, kmers and cigars are valid if threaded
+*/
+enum { DUP_SHORT, DUP_SUB, DUP_KF, DUP_ASGN };
+
+struct dup_entry_t {
+	uint64_t h1 = 0, h2 = 0;
+	bool valid = false, threaded = false;
+	int stage = 0;
+	int kf1 = 0, kf2 = 0, hf1 = 0, hf2 = 0, rm1 = 0, rm2 = 0, nm1 = 0, nm2 = 0, alned0 = 0, alned1 = 0;
+	uint64_t destLocus = 0, destLocus0 = 0;
+	vector<uint64_t> kmers1, kmers2;           // canonical kmers, used by -xg
+	vector<uint64_t> noncakmers0, noncakmers1; // raw kmers, used by threading
+	vector<uint64_t> akmers0, akmers1;         // aligned kmers, used by threading
+	cigar_t r1, r2;
+
+	void filtered(int stage_, int kf1_, int kf2_, int hf1_, int hf2_) {
+		stage = stage_;
+		kf1 = kf1_; kf2 = kf2_;
+		hf1 = hf1_; hf2 = hf2_;
+		threaded = false;
+	}
+};
+
+// bounded per-thread cache of read pair outcomes; direct-mapped, a colliding pair evicts the old entry
+struct dup_cache_t {
+	vector<dup_entry_t> slots;
+	uint64_t mask = 0;
+	uint64_t nlookup = 0, nhit = 0;
+
+	void init(uint64_t n) {
+		if (not n) { return; }
+		uint64_t size = 1;
+		while (size < n) { size <<= 1; }
+		slots.resize(size);
+		mask = size - 1;
+	}
+
+	bool enabled() { return slots.size(); }
+
+	uint64_t bytes() const {
+		uint64_t n = vecBytes(slots);
+		for (auto& e : slots) {
+			n += vecBytes(e.kmers1) + vecBytes(e.kmers2) + vecBytes(e.noncakmers0) + vecBytes(e.noncakmers1) + vecBytes(e.akmers0) + vecBytes(e.akmers1);
+			n += vecBytes(e.r1.es) + vecBytes(e.r1.tr) + vecBytes(e.r2.es) + vecBytes(e.r2.tr);
+		}
+		return n;
+	}
+
+	dup_entry_t* probe(const string& seq, const string& seq1, bool& hit) {
+		uint64_t h1 = 0x9368e53c2f6af274ULL, h2 = 0x586dcd208f7cd3fdULL;
+		hash128(seq, h1, h2);
+		hash128(seq1, h1, h2);
+		dup_entry_t& e = slots[h1 & mask];
+		++nlookup;
+		hit = e.valid and e.h1 == h1 and e.h2 == h2;
+		if (hit) { ++nhit; }
+		else {
+			e.valid = true;
+			e.h1 = h1;
+			e.h2 = h2;
+			e.threaded = false;
+		}
+		return &e;
+	}
+};
+
+
 bool subfilter(vector<uint64_t>& kmers1, vector<uint64_t>& kmers2, kmerIndex_uint32_umap& kmerDBi, uint64_t& nhash) {
 	uint64_t L1 = kmers1.size(), L2 = kmers2.size();
 	uint64_t S1 = L1 / (N_FILTER-1), S2 = L2 / (N_FILTER-1);
@@ -357,7 +453,7 @@ inline bool get_acm2(asgn_t& top, asgn_t& second, uint64_t rem) {
 }
 
 void find_matching_locus(vector<uint32_t>& kmerDBi_vv, vector<kmerIndex_uint32_umap::iterator>& its1, vector<uint32_t>& hits1, vector<uint32_t>& hits2, 
-                         vector<PE_KMC>& dup, vector<uint64_t>& remain, asgn_t& top, asgn_t& second, uint16_t Cthreshold) {
+                         vector<PE_KMC>& dup, vector<uint64_t>& remain, asgn_t& top, asgn_t& second, uint16_t Cthreshold, uint32_t* ncand = nullptr) {
 	for (uint64_t i = 0; i < its1.size(); ++i) {
 		uint32_t vi = its1[i]->second;
 		if (vi % 2) {
@@ -365,12 +461,14 @@ void find_matching_locus(vector<uint32_t>& kmerDBi_vv, vector<kmerIndex_uint32_u
 			uint64_t j1 = j0 + kmerDBi_vv[vi>>1];
 			for ( ; j0 < j1; ++j0) {
 				uint32_t locus = kmerDBi_vv[j0];
+				if (ncand and hits1[locus] + hits2[locus] == 0) { ++*ncand; }
 				hits1[locus] += dup[i].first; // XXX speedup; try unordered_map for hits?
 				hits2[locus] += dup[i].second;
 				updatetop2(hits1[locus], locus, hits2[locus], top, second);
 			}
 		} else {
 			uint32_t locus = vi >> 1;
+			if (ncand and hits1[locus] + hits2[locus] == 0) { ++*ncand; }
 			hits1[locus] += dup[i].first;
 			hits2[locus] += dup[i].second;
 			updatetop2(hits1[locus], locus, hits2[locus], top, second);
@@ -416,7 +514,7 @@ void find_matching_locus(vector<uint32_t>& kmerDBi_vv, vector<kmerIndex_uint32_u
 	}
 }
 
-uint64_t countHit(vector<uint32_t>& kmerDBi_vv, vector<kmerIndex_uint32_umap::iterator>& its1, vector<kmerIndex_uint32_umap::iterator>& its2, vector<uint32_t>& hits1, vector<uint32_t>& hits2, vector<PE_KMC>& dup, uint64_t nloci, uint16_t Cthreshold, log_t& log, uint64_t& tri0, int& nmatch1, int& nmatch2, int& hf1, int& hf2, int& rm1, int& rm2) {
+uint64_t countHit(vector<uint32_t>& kmerDBi_vv, vector<kmerIndex_uint32_umap::iterator>& its1, vector<kmerIndex_uint32_umap::iterator>& its2, vector<uint32_t>& hits1, vector<uint32_t>& hits2, vector<PE_KMC>& dup, uint64_t nloci, uint16_t Cthreshold, log_t& log, uint64_t& tri0, int& nmatch1, int& nmatch2, int& hf1, int& hf2, int& rm1, int& rm2, uint32_t* ncand = nullptr) {
 	uint64_t tri;
 	// pre-processing: sort kmer by # mapped loci XXX alternative: sort by frequncy in read
 	vector<uint64_t> remain;
@@ -427,7 +525,7 @@ uint64_t countHit(vector<uint32_t>& kmerDBi_vv, vector<kmerIndex_uint32_umap::it
 	asgn_t top, second;
 	std::fill(hits1.begin(), hits1.end(), 0);
 	std::fill(hits2.begin(), hits2.end(), 0);
-	find_matching_locus(kmerDBi_vv, its1, hits1, hits2, dup, remain, top, second, Cthreshold);
+	find_matching_locus(kmerDBi_vv, its1, hits1, hits2, dup, remain, top, second, Cthreshold, ncand);
 	tri0 = top.idx;
 	nmatch1 = top.fc;
 	nmatch2 = top.rc;
@@ -447,6 +545,13 @@ uint64_t countHit(vector<uint32_t>& kmerDBi_vv, vector<kmerIndex_uint32_umap::it
 	return tri;
 }
 
+// -sh: shard of a read pair, from its name after prunePEinfo so both mates agree
+inline uint64_t readShard(const string& title, uint64_t nshard) {
+	uint64_t h1 = 0, h2 = 0;
+	hash128(title, h1, h2);
+	return h1 % nshard;
+}
+
 inline void prunePEinfo(string& title) {
 	uint64_t len = title.size();
 	if (title[len-2] == '/') {
@@ -456,18 +561,6 @@ inline void prunePEinfo(string& title) {
 	}
 }
 
-// skip step 1, read destLocus from >[READ_NAME]:[DEST_LOCUS]_[1|2]
-void parseReadNames(vector<string>& titles, vector<uint64_t>& destLoci, uint64_t nReads_) {
-	uint64_t ri = 0;
-	for (uint64_t di = 0; di < nReads_/2; ++di) {
-		uint64_t beg = titles[ri].size() - 1;
-		uint64_t len = 1;
-		while (titles[ri][--beg] != ':') { ++len; }
-		destLoci[di] = stoul(titles[ri].substr(++beg, len));
-		ri += 2;
-	}
-}
-
 // simmode = 1; simmulated reads from TR only
 template <typename ValueType>
 void parseReadName(string& title, uint64_t readn, vector<ValueType>& loci, vector<uint64_t>& locusReadi) {
@@ -1106,8 +1199,9 @@ void annot_gap(uint64_t gap, uint64_t ki, cigar_t& cg, uint64_t& nskip) {
 }
 
 // 0: not feasible, 1: feasible, w/o correction, 2: feasible w/ correction
+// nattempt: if given, incremented for every error correction attempt
 int isThreadFeasible(GraphType& g, string& seq, vector<uint64_t>& noncakmers, vector<uint64_t>& kmers, uint64_t thread_cth, bool correction, 
-	cigar_t& cg, kmer_aCount_umap& trKmers, log_t& log) {
+	cigar_t& cg, kmer_aCount_umap& trKmers, log_t& log, uint64_t* nattempt = nullptr) {
 
 	read2kmers(noncakmers, seq, ksize, 0, 0, false, true); // leftflank = 0, rightflank = 0, canonical = false, keepN = true
 	kmers = noncakmers;
@@ -1128,6 +1222,7 @@ int isThreadFeasible(GraphType& g, string& seq, vector<uint64_t>& noncakmers, ve
 				mes = (ki >= 2*MSC + 2) ? 2 : 1;
 				thread_ext_t txtr(MSC, mes, true);
 				vector<uint64_t> kmers_rc;
+				if (nattempt) { ++*nattempt; }
 				bool skip = errorCorrection_backward(node, g, kmers, kmers_rc, ki, txtr, mes, log);
 				if (not skip) {
 					txtr.edit_kmers_backward(kmers, seq, ki, cg, trKmers, log, ncorrection, nskip);
@@ -1182,6 +1277,7 @@ int isThreadFeasible(GraphType& g, string& seq, vector<uint64_t>& noncakmers, ve
 			if (correction and ncorrection < maxncorrection) {
 				mes = (kmers.size()-ki >= 2*MSC + 2) ? 2 : 1;
 				thread_ext_t txtf(MSC, mes, false);
+				if (nattempt) { ++*nattempt; }
 				skip = errorCorrection_forward(nnds, g, kmers, ki, nts0, txtf, mes, log);
 
 				if (not skip) { // passed forward correction
@@ -1197,6 +1293,7 @@ int isThreadFeasible(GraphType& g, string& seq, vector<uint64_t>& noncakmers, ve
 					if (not find_anchor(g, kmers, cg, nskip, ki, trKmers, node)) { break; }
 					mes = 2; // always have enough info to make 2 edits
 					thread_ext_t txtr(MSC, mes, true);
+					if (nattempt) { ++*nattempt; }
 					skip = errorCorrection_backward(node, g, kmers, kmers_rc, ki, txtr, mes, log);
 
 					if (not skip) { // passed reverse correction
@@ -1215,6 +1312,7 @@ int isThreadFeasible(GraphType& g, string& seq, vector<uint64_t>& noncakmers, ve
 							vector<uint64_t> kmers_rc;
 							uint64_t node_ = kmers[ki1];
 							assert(g.count(node_));
+							if (nattempt) { ++*nattempt; }
 							skip = errorCorrection_backward(node_, g, kmers, kmers_rc, ki1, txtr, mes, log);
 							if (not skip) {
 								txtr.edit_kmers_backward(kmers, seq, ki1, cg, trKmers, log, ncorrection, nskip);
@@ -1483,8 +1581,49 @@ void assignTRkmc(vector<uint64_t>& kmers, kmer_aCount_umap& trKmers, GraphType&
 	}
 }
 
+// -bu: novel edges of one worker as (locus, edge, count), appended without locking and
+// periodically sorted and reduced, so the buffer stays about twice the # of distinct edges
+struct bubble_edge_t {
+	uint64_t edge;
+	uint32_t locus;
+	uint64_t count; // summed over compactions until the next merge, can exceed 32 bits
+	bool operator<(const bubble_edge_t& o) const { return locus != o.locus ? locus < o.locus : edge < o.edge; }
+};
+
+struct bubble_buf_t {
+	static const size_t MIN_LIMIT = 1 << 16;
+	vector<bubble_edge_t> v;
+	size_t limit = MIN_LIMIT;
+
+	void add(uint32_t locus, uint64_t edge) {
+		v.push_back({edge, locus, 1});
+		if (v.size() >= limit) { compact(); }
+	}
+
+	void compact() {
+		std::sort(v.begin(), v.end());
+		size_t j = 0;
+		for (size_t i = 0; i < v.size(); ++i) {
+			if (j and v[j-1].locus == v[i].locus and v[j-1].edge == v[i].edge) { v[j-1].count += v[i].count; }
+			else { v[j++] = v[i]; }
+		}
+		v.resize(j);
+		limit = 2 * j > MIN_LIMIT ? 2 * j : MIN_LIMIT;
+	}
+};
+
+// edges of destLocus for countNovelEdges
+struct bubble_sink_t {
+	bubble_buf_t& buf;
+	uint32_t locus;
+};
+
+inline void addEdge(kmerCount_umap& bu, uint64_t e) { ++bu[e]; }
+inline void addEdge(bubble_sink_t& bu, uint64_t e) { bu.buf.add(bu.locus, e); }
+
 // bu: bubble
-void countNovelEdges(vector<uint64_t>& noncakmers, GraphType& g, kmerCount_umap& bu) {
+template <typename BubbleType>
+void countNovelEdges(vector<uint64_t>& noncakmers, GraphType& g, BubbleType& bu) {
 	uint64_t km0, km1, e, n;
 	bool nnts[4];
 	GraphType::iterator it;
@@ -1497,7 +1636,7 @@ void countNovelEdges(vector<uint64_t>& noncakmers, GraphType& g, kmerCount_umap&
 		while (it == g.end()) {
 			if (km0 != -1ULL and km1 != -1ULL) {
 				e = (km0 << 2) + (km1 % 4);
-				++bu[e];
+				addEdge(bu, e);
 			}
 			km0 = km1;
 			it = km0 != -1ULL? g.find(km0) : g.end();
@@ -1509,7 +1648,7 @@ void countNovelEdges(vector<uint64_t>& noncakmers, GraphType& g, kmerCount_umap&
 			fill_nnts(it, nnts);
 			if (not nnts[km1%4]) {
 				e = (km0 << 2) + (km1 % 4);
-				++bu[e];
+				addEdge(bu, e);
 			}
 		}
 		km0 = km1;
@@ -1517,44 +1656,59 @@ void countNovelEdges(vector<uint64_t>& noncakmers, GraphType& g, kmerCount_umap&
 	}
 }
 
-void accumBubbles(bubbles_t& bubbles, bubble_db_t& bubbleDB) {
-	for (auto& p : bubbles) {
-		uint64_t destLocus = p.first;
-		auto& bu_i = p.second;
-		auto& bu_o = bubbleDB[destLocus];
-		for (auto& q : bu_i) { bu_o[q.first] += q.second; }
+// sums and empties the buffers; each of nthreads threads merges a contiguous range of loci
+void mergeBubbles(vector<bubble_buf_t*>& bufs, bubble_db_t& bubbleDB, int nthreads) {
+	vector<std::thread> ths;
+	for (bubble_buf_t* buf : bufs) { ths.emplace_back(&bubble_buf_t::compact, buf); }
+	for (auto& th : ths) { th.join(); }
+	ths.clear();
+	uint64_t nloci = bubbleDB.size();
+	nthreads = std::max<uint64_t>(1, std::min<uint64_t>(nthreads, nloci));
+	for (int t = 0; t < nthreads; ++t) {
+		ths.emplace_back([&bufs, &bubbleDB, nloci, nthreads, t]() {
+			uint32_t beg = nloci * t / nthreads, end = nloci * (t + 1) / nthreads;
+			for (bubble_buf_t* buf : bufs) {
+				auto it = std::lower_bound(buf->v.begin(), buf->v.end(), bubble_edge_t{0, beg, 0});
+				for (; it != buf->v.end() and it->locus < end; ++it) { bubbleDB[it->locus][it->edge] += it->count; }
+			}
+		});
+	}
+	for (auto& th : ths) { th.join(); }
+	for (bubble_buf_t* buf : bufs) {
+		vector<bubble_edge_t>().swap(buf->v);
+		buf->limit = bubble_buf_t::MIN_LIMIT;
 	}
 }
 
-void writeExtractedReads(int extractFastX, vector<string>& seqs, vector<string>& quals, vector<string>& titles, vector<uint64_t>& extractindices, vector<uint64_t>& assignedloci) {
+void writeExtractedReads(ostream& out, int extractFastX, vector<string>& seqs, vector<string>& quals, vector<string>& titles, vector<uint64_t>& extractindices, vector<uint64_t>& assignedloci) {
 	for (uint64_t i = 0; i < extractindices.size(); ++i) {
-		if (extractFastX == 1) { cout << titles[--extractindices[i]] << '\n'; } 
-		else { cout << titles[--extractindices[i]] << ":" << assignedloci[i] << '\n'; }
-		cout << seqs[extractindices[i]] << '\n';
-		cout << "+\n";
-		cout << quals[extractindices[i]] << '\n';
-
-		if (extractFastX == 1) { cout << titles[--extractindices[i]] << '\n'; } 
-		else { cout << titles[--extractindices[i]] << ":" << assignedloci[i] << '\n'; }
-		cout << seqs[extractindices[i]] << '\n';
-		cout << "+\n";
-		cout << quals[extractindices[i]] << '\n';
+		if (extractFastX == 1) { out << titles[--extractindices[i]] << '\n'; } 
+		else { out << titles[--extractindices[i]] << ":" << assignedloci[i] << '\n'; }
+		out << seqs[extractindices[i]] << '\n';
+		out << "+\n";
+		out << quals[extractindices[i]] << '\n';
+
+		if (extractFastX == 1) { out << titles[--extractindices[i]] << '\n'; } 
+		else { out << titles[--extractindices[i]] << ":" << assignedloci[i] << '\n'; }
+		out << seqs[extractindices[i]] << '\n';
+		out << "+\n";
+		out << quals[extractindices[i]] << '\n';
 	}
 }
 
-void writeExtractedReads(int extractFastX, vector<string>& seqs, vector<string>& titles, vector<uint64_t>& extractindices, vector<uint64_t>& assignedloci) {
+void writeExtractedReads(ostream& out, int extractFastX, vector<string>& seqs, vector<string>& titles, vector<uint64_t>& extractindices, vector<uint64_t>& assignedloci) {
 	for (uint64_t i = 0; i < extractindices.size(); ++i) {
-		if (extractFastX == 1) { cout << titles[--extractindices[i]] << '\n'; } 
-		else { cout << titles[--extractindices[i]] << ":" << assignedloci[i] << '\n'; }
-		cout << seqs[extractindices[i]] << '\n';
+		if (extractFastX == 1) { out << titles[--extractindices[i]] << '\n'; } 
+		else { out << titles[--extractindices[i]] << ":" << assignedloci[i] << '\n'; }
+		out << seqs[extractindices[i]] << '\n';
 
-		if (extractFastX == 1) { cout << titles[--extractindices[i]] << '\n'; } 
-		else { cout << titles[--extractindices[i]] << ":" << assignedloci[i] << '\n'; }
-		cout << seqs[extractindices[i]] << '\n';
+		if (extractFastX == 1) { out << titles[--extractindices[i]] << '\n'; } 
+		else { out << titles[--extractindices[i]] << ":" << assignedloci[i] << '\n'; }
+		out << seqs[extractindices[i]] << '\n';
 	}
 }
 
-void writeKmerAssignments(vector<string>& seqs, vector<string>& titles, vector<uint64_t>& destLoci, vector<uint64_t>& alnindices, vector<km_asgn_t>& kams) {
+void writeKmerAssignments(ostream& out, vector<string>& seqs, vector<string>& titles, vector<uint64_t>& destLoci, vector<uint64_t>& alnindices, vector<km_asgn_t>& kams) {
 	string NA = {"."};
 	for (uint64_t i = 0; i < kams.size(); ++i) {
 		auto& kam = kams[i];
@@ -1565,7 +1719,7 @@ void writeKmerAssignments(vector<string>& seqs, vector<string>& titles, vector<u
 		string src = kam.src == -1ULL ? NA : to_string(kam.src);
 		string si1 = r1.si==-1 ? NA : to_string(r1.si);
 		string si2 = r2.si==-1 ? NA : to_string(r2.si);
-		cout << src << '\t'
+		out << src << '\t'
 			 << kam.dst << '\t'
 			 << kam.dst0 << '\t'
 			 << (r2.ei - r2.si) << '\t'
@@ -1581,26 +1735,26 @@ void writeKmerAssignments(vector<string>& seqs, vector<string>& titles, vector<u
 	}
 }
 
-void writeAnnot(vector<char> tr) { // XXX obsolete code, char can only be [=.*]
-	if (not tr.size()) { cout << '*'; return; }
+void writeAnnot(ostream& out, const vector<char>& tr) { // XXX obsolete code, char can only be [=.*]
+	if (not tr.size()) { out << '*'; return; }
 	int ct = 1;
 	char c0; // last_annot
 	c0 = tr[0];
 	for (int i = 1; i < tr.size(); ++i) {
 		if (c0 == '=' or c0 == '.' or c0 == '*') {
 			while (tr[i] == c0) { ++ct; ++i; if (i == tr.size()) { break; } }
-			cout << ct << c0;
+			out << ct << c0;
 		}
-		else { cout << c0; }
+		else { out << c0; }
 		if (i == tr.size()) { return; }
 		ct = 1;
 		c0 = tr[i];
 	}
-	cout << ct << c0;
+	out << ct << c0;
 }
 
-void writeCigar(vector<edit_t> edits) {
-	if (not edits.size()) { cout << '*'; return; }
+void writeCigar(ostream& out, const vector<edit_t>& edits) {
+	if (not edits.size()) { out << '*'; return; }
 
 	int ct = 1;
 	edit_t e0, e1; // last_edit
@@ -1613,78 +1767,277 @@ void writeCigar(vector<edit_t> edits) {
 				if (i == edits.size()) { break; }
 				e1 = edits[i];
 			}
-			cout << ct << e0.t;
+			out << ct << e0.t;
 		}
 		else if (e0.t == 'X') {
-			cout << 'X' << e0.g;
+			out << 'X' << e0.g;
 		}
 		else if (e0.t == 'D') {
 			if (e1.t == 'I') { // special case, merging ins and del as mismatch
-				cout << 'X' << e0.g;
+				out << 'X' << e0.g;
 				++i;
 			}
-			else { cout << 'D' << e0.g; }
+			else { out << 'D' << e0.g; }
 		}
 		else if (e0.t == 'I') {
 			if (e1.t == 'D') { // special case, merging ins and del as mismatch
-				cout << 'X' << e1.g;
+				out << 'X' << e1.g;
 				++i;
 			}
-			else { cout << 'I'; }
+			else { out << 'I'; }
 		}
-		else { cout << e0.t; }
+		else { out << e0.t; }
 		if (i == edits.size()) { return; }
 		ct = 1;
 		e0 = edits[i];
 	}
-	cout << ct << e0.t;
+	out << ct << e0.t;
 }
 
-void writeAlignments(vector<string>& seqs, vector<string>& titles, vector<uint64_t>& alnindices, vector<sam_t>& sams) {
+void writeAlignments(ostream& out, vector<string>& seqs, vector<string>& titles, vector<uint64_t>& alnindices, vector<sam_t>& sams) {
 	for (uint64_t i = 0; i < sams.size(); ++i) {
-		if (sams[i].src == -1ULL) { cout << '.' << '\t'; }
-		else { cout << sams[i].src << '\t'; }
-		cout << sams[i].dst << '\t'
+		if (sams[i].src == -1ULL) { out << '.' << '\t'; }
+		else { out << sams[i].src << '\t'; }
+		out << sams[i].dst << '\t'
 			 << titles[--alnindices[i]] << '\t'
 			 << seqs[alnindices[i]] << '\t'
 			 << seqs[--alnindices[i]] << '\t';
-		writeCigar(sams[i].r2.es); // read2.es
-		cout << '\t';
-		writeAnnot(sams[i].r2.tr); // read2.tr
-		cout << '\t';
-		writeCigar(sams[i].r1.es); // read1.es
-		cout << '\t';
-		writeAnnot(sams[i].r1.tr); // read1.tr
-		cout << '\n';
+		writeCigar(out, sams[i].r2.es); // read2.es
+		out << '\t';
+		writeAnnot(out, sams[i].r2.tr); // read2.tr
+		out << '\t';
+		writeCigar(out, sams[i].r1.es); // read1.es
+		out << '\t';
+		writeAnnot(out, sams[i].r1.tr); // read1.tr
+		out << '\n';
 	}
 }
 
-void writeAlignments(vector<string>& seqs, vector<string>& titles, vector<uint64_t>& destLoci, vector<uint64_t>& alnindices, vector<sam_t>& sams) {
+void writeAlignments(ostream& out, vector<string>& seqs, vector<string>& titles, vector<uint64_t>& destLoci, vector<uint64_t>& alnindices, vector<sam_t>& sams) {
 	for (uint64_t i = 0; i < sams.size(); ++i) {
-		if (sams[i].src == -1ULL) { cout << '.' << '\t'; }
-		else { cout << sams[i].src << '\t'; }
-		cout << sams[i].dst << '\t'
+		if (sams[i].src == -1ULL) { out << '.' << '\t'; }
+		else { out << sams[i].src << '\t'; }
+		out << sams[i].dst << '\t'
 			 << titles[--alnindices[i]] << '\t'
 			 << seqs[alnindices[i]] << '\t'
 			 << seqs[--alnindices[i]] << '\t';
-		writeCigar(sams[i].r2.es); // read2.es
-		cout << '\t';
-		writeAnnot(sams[i].r2.tr); // read2.tr
-		cout << '\t';
-		writeCigar(sams[i].r1.es); // read1.es
-		cout << '\t';
-		writeAnnot(sams[i].r1.tr); // read1.tr
-		cout << '\n';
+		writeCigar(out, sams[i].r2.es); // read2.es
+		out << '\t';
+		writeAnnot(out, sams[i].r2.tr); // read2.tr
+		out << '\t';
+		writeCigar(out, sams[i].r1.es); // read1.es
+		out << '\t';
+		writeAnnot(out, sams[i].r1.tr); // read1.tr
+		out << '\n';
+	}
+}
+// binary counterparts of writeCigar and writeAnnot, see alnbin.h; ops is a scratch buffer
+void encodeCigar(string& out, const vector<edit_t>& edits, string& ops) {
+	if (not edits.size()) { putVarint(out, 0); return; }
+
+	ops.clear();
+	uint64_t nops = 0;
+	int ct = 1;
+	edit_t e0, e1; // last_edit
+	e0 = edits[0];
+	for (int i = 1; i < edits.size(); ++i) {
+		e1 = edits[i];
+		++nops;
+		if (e0.t == '=' or e0.t == '.' or e0.t == '*') {
+			while (e1.t == e0.t) {
+				++ct; ++i;
+				if (i == edits.size()) { break; }
+				e1 = edits[i];
+			}
+			putRun(ops, ct, e0.t);
+		}
+		else if (e0.t == 'X') {
+			putVarint(ops, ALN_OP_X); ops += e0.g;
+		}
+		else if (e0.t == 'D') {
+			if (e1.t == 'I') { // special case, merging ins and del as mismatch
+				putVarint(ops, ALN_OP_X); ops += e0.g;
+				++i;
+			}
+			else { putVarint(ops, ALN_OP_D); ops += e0.g; }
+		}
+		else if (e0.t == 'I') {
+			if (e1.t == 'D') { // special case, merging ins and del as mismatch
+				putVarint(ops, ALN_OP_X); ops += e1.g;
+				++i;
+			}
+			else { putVarint(ops, ALN_OP_I); }
+		}
+		else { putVarint(ops, ((uint64_t)e0.t << 3) | ALN_OP_CHAR); }
+		if (i == edits.size()) {
+			putVarint(out, nops);
+			out += ops;
+			return;
+		}
+		ct = 1;
+		e0 = edits[i];
 	}
+	putRun(ops, ct, e0.t);
+	putVarint(out, nops + 1);
+	out += ops;
 }
+void encodeAnnot(string& out, const vector<char>& tr, string& ops) {
+	if (not tr.size()) { putVarint(out, 0); return; }
 
+	ops.clear();
+	uint64_t nops = 0;
+	int ct = 1;
+	char c0; // last_annot
+	c0 = tr[0];
+	for (int i = 1; i < tr.size(); ++i) {
+		++nops;
+		if (c0 == '=' or c0 == '.' or c0 == '*') {
+			while (tr[i] == c0) { ++ct; ++i; if (i == tr.size()) { break; } }
+			putRun(ops, ct, c0);
+		}
+		else { putVarint(ops, ((uint64_t)(unsigned char)c0 << 3) | ALN_OP_CHAR); }
+		if (i == tr.size()) {
+			putVarint(out, nops);
+			out += ops;
+			return;
+		}
+		ct = 1;
+		c0 = tr[i];
+	}
+	putRun(ops, ct, c0);
+	putVarint(out, nops + 1);
+	out += ops;
+}
+// binary counterpart of writeAlignments; loci gets the sorted destination loci of the records
+void encodeAlignments(string& out, vector<string>& seqs, vector<string>& titles, vector<uint64_t>& alnindices, vector<sam_t>& sams, vector<uint32_t>& loci) {
+	string rec, ops;
+	uint64_t h1, h2;
+	for (uint64_t i = 0; i < sams.size(); ++i) {
+		sam_t& s = sams[i];
+		rec.clear();
+		putVarint(rec, s.src == -1 ? 0 : s.src + 1);
+		putVarint(rec, s.dst);
+		h1 = h2 = 0;
+		hash128(titles[--alnindices[i]], h1, h2);
+		putU64(rec, h1);
+		encodeSeq(rec, seqs[alnindices[i]]);
+		encodeSeq(rec, seqs[--alnindices[i]]);
+		encodeCigar(rec, s.r2.es, ops); // read2.es
+		encodeAnnot(rec, s.r2.tr, ops); // read2.tr
+		encodeCigar(rec, s.r1.es, ops); // read1.es
+		encodeAnnot(rec, s.r1.tr, ops); // read1.tr
+		putVarint(out, rec.size());
+		out += rec;
+		loci.push_back(s.dst);
+	}
+	std::sort(loci.begin(), loci.end());
+	loci.erase(std::unique(loci.begin(), loci.end()), loci.end());
+}
+
+// -eb: binary counterpart of writeExtractedReads; loci gets the sorted loci of the records
+void encodeReadPairs(string& out, vector<string>& seqs, vector<string>& quals, vector<string>& titles, vector<uint64_t>& extractindices,
+                     vector<uint64_t>& assignedloci, vector<readbin_pair_t>& rbpairs, bool isFastq, vector<uint32_t>& loci) {
+	string rec;
+	for (uint64_t i = 0; i < extractindices.size(); ++i) {
+		uint64_t j = extractindices[i]; // the next pair
+		encodeReadPair(out, rec, assignedloci[i], rbpairs[i], titles[j-2], seqs[j-2], seqs[j-1], isFastq ? &quals[j-2] : nullptr, isFastq ? &quals[j-1] : nullptr);
+		loci.push_back(assignedloci[i]);
+	}
+	std::sort(loci.begin(), loci.end());
+	loci.erase(std::unique(loci.begin(), loci.end()), loci.end());
+}
+
+// -lc only; per destLocus threading cost
+struct locus_cost_t {
+	uint64_t npair = 0, ncorr = 0, nfail = 0; // threaded pairs, correction attempts, reads failing threading
+	double sec = 0; // time in isThreadFeasible
+};
+
+// loci sorted by total threading time, loci never threaded are omitted
+void writeLocusCost(string fn, vector<locus_cost_t>& lcost) {
+	vector<uint64_t> loci;
+	for (uint64_t i = 0; i < lcost.size(); ++i) {
+		if (lcost[i].npair) { loci.push_back(i); }
+	}
+	std::stable_sort(loci.begin(), loci.end(), [&](uint64_t a, uint64_t b) { return lcost[a].sec > lcost[b].sec; });
+	ofstream fout(fn);
+	assert(fout);
+	fout << "locus\tpairs\tsec\tus_per_pair\tcorrection_attempts\tfailed_reads\n";
+	for (uint64_t i : loci) {
+		locus_cost_t& c = lcost[i];
+		fout << i << '\t' << c.npair << '\t' << c.sec << '\t' << c.sec / c.npair * 1e6 << '\t' << c.ncorr << '\t' << c.nfail << '\n';
+	}
+	fout.close();
+}
+
+// -qc only; read pairs of a locus by stage and threading statistics
+struct locus_qc_t {
+	uint64_t nhit = 0, nassigned = 0; // pairs whose best locus in countHit is this one, of which assigned
+	uint64_t nkf = 0; // reads of the hit pairs removed by kfilter
+	uint64_t nthreaded = 0, nbait = 0, nasgn = 0; // pairs passing threading, reads removed by bait, reads counted by asgn
+	uint64_t ncol = 0, nedit = 0; // alignment columns and edits of threaded reads
+	uint64_t nflank = 0, ntr = 0; // flank and TR kmers on the threads
+
+	void add(const locus_qc_t& o) {
+		nhit += o.nhit; nassigned += o.nassigned; nkf += o.nkf;
+		nthreaded += o.nthreaded; nbait += o.nbait; nasgn += o.nasgn;
+		ncol += o.ncol; nedit += o.nedit; nflank += o.nflank; ntr += o.ntr;
+	}
+
+	void addThread(const cigar_t& cg) {
+		for (char c : cg.tr) {
+			nflank += c == '.';
+			ntr += c == '=';
+		}
+		for (const edit_t& e : cg.es) {
+			if (e.t == '=') { ++ncol; }
+			else if (e.t == 'X' or e.t == 'I' or e.t == 'D') { ++ncol; ++nedit; }
+		}
+	}
+};
+
+// One line per locus (loaded loci only with -lo). Depths are per distinct kmer: tr_depth from the
+// final TR kmer counts, flank_depth from the flank kmers on the threads over the flank kmers of the graph.
+void writeLocusQC(string fn, vector<locus_qc_t>& qc, vector<kmer_aCount_umap>& trResults, vector<GraphType>& graphDB, const vector<bool>* locusSel) {
+	ofstream fout(fn);
+	assert(fout);
+	fout << "locus\thit_pairs\tassigned_pairs\tkfiltered_reads\tthreaded_pairs\tbait_filtered_reads\tasgn_reads"
+	     << "\ttr_kmers\ttr_depth\tflank_kmers\tflank_depth\tedit_rate\n";
+	vector<uint64_t> ckmers;
+	for (uint64_t i = 0; i < qc.size(); ++i) {
+		if (locusSel and not (*locusSel)[i]) { continue; }
+		locus_qc_t& q = qc[i];
+		kmer_aCount_umap& tr = trResults[i];
+		uint64_t trsum = 0, nflank = 0;
+		for (auto& p : tr) { trsum += p.second; }
+		ckmers.clear();
+		for (auto& p : graphDB[i]) { ckmers.push_back(toCaKmer(p.first, ksize)); }
+		std::sort(ckmers.begin(), ckmers.end());
+		ckmers.erase(std::unique(ckmers.begin(), ckmers.end()), ckmers.end());
+		for (uint64_t km : ckmers) { nflank += tr.count(km) == 0; }
+		fout << i << '\t' << q.nhit << '\t' << q.nassigned << '\t' << q.nkf << '\t' << q.nthreaded << '\t' << q.nbait << '\t' << q.nasgn
+		     << '\t' << tr.size() << '\t' << (tr.size() ? (double)trsum / tr.size() : 0)
+		     << '\t' << nflank << '\t' << (nflank ? (double)q.nflank / nflank : 0)
+		     << '\t' << (q.ncol ? (double)q.nedit / q.ncol : 0) << '\n';
+	}
+	fout.close();
+}
+
+
+// -numa: read-only RPGG structures of one NUMA node
+struct rpgg_replica_t {
+	kmerIndex_uint32_umap kmerDBi;
+	vector<uint32_t> kmerDBi_vv;
+	vector<GraphType> graphDB;
+};
 
 class Counts {
 public:
-	bool isFastq, outputBubbles, bait, threading, correction, tc, aln, aln_minimal, g2pan, skip1, invkmer;
+	bool isFastq, outputBubbles, bait, threading, correction, tc, aln, aln_minimal, g2pan, skip1, invkmer, dedup;
 	uint16_t Cthreshold, thread_cth;
 	uint64_t *nReads, *nThreadingReads, *nFeasibleReads, *nAsgnReads, *nSubFiltered, *nKmerFiltered, *nBaitFiltered, *nLocusAssignFiltered;
-	uint64_t nloci;
+	uint64_t *nDupLookup, *nDupHit;
+	uint64_t nloci, dupCacheSize, filterWorkers, threadWorkers;
 	int countMode;
 	float readsPerBatchFactor;
 	unordered_map<string, string>* readDB;
@@ -1704,125 +2057,647 @@ public:
 	vector<msa_umap>* msaStats;
 	err_umap* errdb;
 	vector<uint64_t>* locusmap;
+	vector<bool>* locusSel; // -lo, nullptr: all loci
 	// extractFastX only
 	int extractFastX;
+	out_writer_t* writer;
+	int bgzfLevel; // -1: plain text
+	bool fixedBatchSize;
+	uint64_t inSize; // size of the input file, 0 if unknown (e.g. a pipe)
+	ofstream* metricsOut; // nullptr: metrics off
+	bool perfCounters; // -pc, requires metricsOut
+	bool locusCost, locusQC;
+	bool alnBinary;
+	bool readBinary; // -eb
+	readbin_reader_t* readBin; // -rb, nullptr: fastx input
+	double metricsInterval;
+	double ckptInterval; // -ck, 0: off
+	uint64_t shard, nshard; // -sh
+	string ckptFname, ckptArgs;
+	uint64_t outBytes; // bytes written to STDOUT by previous runs (-ck)
+	uint64_t readMemBudget; // -mb: bytes left for reads after loading, 0: no budget
+	// -numa, nullptr: off. Node n > 0 probes replicas[n-1], node 0 kmerDBi, kmerDBi_vv and graphDB.
+	vector<vector<int>>* numaCpus;
+	std::deque<rpgg_replica_t>* replicas;
 
 	Counts(uint64_t nloci_) : nloci(nloci_) {}
 };
 
-class Threads {
-public:
-	vector<Counts> counts;
-	Threads(uint64_t nproc, uint64_t nloci) : counts(nproc, Counts(nloci)) {}
+enum { STAGE_READ, STAGE_FILTER, STAGE_THREAD, STAGE_WRITE, N_STAGE };
+const char* stageNames[] = { "read", "filter", "thread", "write" };
+
+// filter-stage results of one read pair that still has a destLocus, handed to the threading stage
+template <typename ValueType>
+struct pair_state_t {
+	uint64_t seqi; // index of the next pair, as in the per-pair loop
+	ValueType srcLocus;
+	uint64_t destLocus0;
+	int rm1, rm2, kf1, kf2, hf1, hf2;
+	bool dhit;
+	vector<uint64_t> kmers1, kmers2; // only kept without threading
 };
 
+// one sub-batch of read pairs; bi orders the output
 template <typename ValueType>
-void CountWords(void *data) {
-	bool isFastq = ((Counts*)data)->isFastq;
-	bool outputBubbles = ((Counts*)data)->outputBubbles;
-	bool bait = ((Counts*)data)->bait;
-	bool threading = ((Counts*)data)->threading;
-	bool correction = ((Counts*)data)->correction;
-	bool tc = ((Counts*)data)->tc;
-	bool aln = ((Counts*)data)->aln;
-	bool aln_minimal = ((Counts*)data)->aln_minimal;
-	bool g2pan = ((Counts*)data)->g2pan;
-	bool skip1 = ((Counts*)data)->skip1; // TODO new functionality: allow skipping step1 by reading assigned locus info from extracted reads
-	bool invkmer = ((Counts*)data)->invkmer;
-	int simmode = ((Counts*)data)->simmode;
-	int countMode = ((Counts*)data)->countMode;
-	int extractFastX = ((Counts*)data)->extractFastX;
-	uint64_t nReads_ = 0, nShort_ = 0, nThreadingReads_ = 0, nFeasibleReads_ = 0, nAsgnReads_ = 0, nSubFiltered_ = 0, nKmerFiltered_ = 0, nBaitFiltered_ = 0, nLocusAssignFiltered_ = 0;
-	uint64_t& nReads = *((Counts*)data)->nReads;
-	uint64_t& nThreadingReads = *((Counts*)data)->nThreadingReads;
-	uint64_t& nFeasibleReads = *((Counts*)data)->nFeasibleReads;
-	uint64_t& nAsgnReads = *((Counts*)data)->nAsgnReads;
-	uint64_t& nSubFiltered = *((Counts*)data)->nSubFiltered;
-	uint64_t& nKmerFiltered = *((Counts*)data)->nKmerFiltered;
-	uint64_t& nBaitFiltered = *((Counts*)data)->nBaitFiltered;
-	uint64_t& nLocusAssignFiltered = *((Counts*)data)->nLocusAssignFiltered;
-	uint16_t Cthreshold = ((Counts*)data)->Cthreshold;
-	uint16_t thread_cth = ((Counts*)data)->thread_cth;
-	float readsPerBatchFactor = ((Counts*)data)->readsPerBatchFactor;
-	const uint64_t nloci = ((Counts*)data)->nloci;
-	const uint64_t readsPerBatch = 300000 * readsPerBatchFactor;
-	const uint64_t minReadSize = Cthreshold + ksize - 1;
-	ifstream *in = ((Counts*)data)->in;
-	unordered_map<string, string>& readDB = *((Counts*)data)->readDB;
-	unordered_map<string, std::pair<string,string>>& fqDB = *((Counts*)data)->fqDB;
-	kmerIndex_uint32_umap& kmerDBi = *((Counts*)data)->kmerDBi;
-	vector<uint32_t>& kmerDBi_vv = *((Counts*)data)->kmerDBi_vv;
-	vector<GraphType>& graphDB = *((Counts*)data)->graphDB;
-	vector<kmer_aCount_umap>& trResults = *((Counts*)data)->trResults;
-	vector<kmer_aCount_umap>& ikmerDB = *((Counts*)data)->ikmerDB;
-	vector<atomic_uint32_t>& nmapread = *((Counts*)data)->nmapread;
-	vector<atomic_uint64_t>& kmc = *((Counts*)data)->kmc;
-	bubble_db_t& bubbleDB = *((Counts*)data)->bubbleDB;
-	//bait_db_t& baitDB = *((Counts*)data)->baitDB;
-	bait_fps_db_t& baitDB = *((Counts*)data)->baitDB;
-	vector<msa_umap>& msaStats = *((Counts*)data)->msaStats;
-	err_umap& errdb = *((Counts*)data)->errdb;
-	err_umap err;
-	vector<uint64_t>& locusmap = *((Counts*)data)->locusmap;
-	vector<string> seqs(readsPerBatch);
-	vector<uint32_t> hits1(nloci+1,0), hits2(nloci+1,0);
-	vector<string> titles(readsPerBatch);
-	vector<string> quals(readsPerBatch);
-	// extractFastX only
-	vector<uint64_t> destLoci(readsPerBatch/2);
+struct batch_t {
+	uint64_t bi, nReads = 0;
+	time_t time2;
+	vector<string> titles, seqs, quals;
 	// simmode only
-	// loci: loci that are processed in this batch
+	// locusReadi: map locus to nReads. 0th item = number of reads for 0th item in srcLoci; last item = nReads; has same length as srcLoci
 	vector<ValueType> srcLoci;
-	vector<uint64_t> poss;
-	unordered_map<uint64_t, msa_umap> msa;
-
-	while (true) {
-
-		string title, title1, seq, seq1, qtitle, qtitle1, qual, qual1;
-		// for simmode only
-		// locusReadi: map locus to nReads_. 0th item = number of reads for 0th item in loci; last item = nReads_; has same length as loci
-		uint64_t startpos;
-		vector<uint64_t> locusReadi;
-		vector<std::pair<int, uint64_t>> meta;
-		// extractFastX only
-		vector<uint64_t> extractindices, assignedloci;
-		// aln only
-		vector<uint64_t> alnindices;
-
-		//
-		// begin thread locking
-		//
-		sem_wait(semreader);
-
-		nThreadingReads += nThreadingReads_;
-		nFeasibleReads += nFeasibleReads_;
-		nAsgnReads += nAsgnReads_;
-		nSubFiltered += nSubFiltered_;
-		nKmerFiltered += nKmerFiltered_;
-		nBaitFiltered += nBaitFiltered_;
-		nLocusAssignFiltered += nLocusAssignFiltered_;
-		nThreadingReads_ = 0;
-		nFeasibleReads_ = 0;
-		nAsgnReads_ = 0;
-		nSubFiltered_ = 0;
-		nKmerFiltered_ = 0;
-		nBaitFiltered_ = 0;
-		nLocusAssignFiltered_ = 0;
-		nReads_ = 0;
-		nShort_ = 0;
-
-		if (simmode == 1 and srcLoci.size() != 0) {
-			srcLoci.clear();
-			msa.clear();
-		}
-
-		if (in->peek() == EOF) {
-			sem_post(semreader);
-			return;
+	vector<uint64_t> locusReadi;
+	vector<std::pair<int, uint64_t>> meta;
+	vector<pair_state_t<ValueType>> pairs;
+	// extractFastX only
+	vector<uint64_t> destLoci, extractindices, assignedloci;
+	vector<readbin_pair_t> rbpairs; // -eb: of each extracted pair; -rb: of each read pair
+	// aln only
+	vector<uint64_t> alnindices;
+	vector<sam_t> sams;
+	vector<uint32_t> chunkLoci; // -ab/-eb only, loci of the records
+	vector<km_asgn_t> kams;
+	string out; // formatted (and possibly compressed) STDOUT content
+	batch_metrics_t mx; // -mx only
+	uint64_t nShort = 0, nThreadingReads = 0, nFeasibleReads = 0, nAsgnReads = 0, nSubFiltered = 0, nKmerFiltered = 0, nBaitFiltered = 0, nLocusAssignFiltered = 0;
+	uint64_t nhash0 = 0, nhash1 = 0, nDupLookup = 0, nDupHit = 0;
+	uint64_t memBytes = 0; // reads as parsed
+
+	batch_t(uint64_t bi_, uint64_t size) : bi(bi_), titles(size), seqs(size), quals(size), destLoci(size/2) {}
+};
+
+// scratch space owned by one pool worker
+struct worker_t {
+	vector<uint32_t> hits1, hits2;
+	// duplicate read pairs reuse the cached filtering/assignment (dupcache) and threading (tdupcache) outcome.
+	// The stages of one batch may run on different workers, so each stage keeps its own cache.
+	dup_cache_t dupcache, tdupcache;
+	std::atomic<uint64_t> busyNs{0}; // time spent reading or running tasks
+	vector<locus_cost_t> lcost; // -lc only
+	vector<locus_qc_t> lqc; // -qc only
+	perf_group_t perf; // -pc only; opened by the worker's own thread on first use
+	bool perfTried = false;
+	bubble_buf_t bubbles; // -bu only; merged into bubbleDB by AlignPool::MergeBubbles()
+	vector<uint64_t> cakmers; // canonical kmers of the pair being counted by ThreadBatch
+	// RPGG probed by this worker; a replica on its own node with -numa
+	kmerIndex_uint32_umap* kmerDBi;
+	vector<uint32_t>* kmerDBi_vv;
+	vector<GraphType>* graphDB;
+	int node = 0; // -numa only
+	bool pinned = false;
+};
+
+/*
+Align pipeline: read -> filter -> thread -> write.
+
+read:   parse and pair reads into sub-batches (serial).
+filter: read2kmers, subfilter, kfilter and countHit.
+thread: graph threading and k-mer counting.
+write:  ordered output of finished sub-batches (serial).
+
+The filter and thread stages are connected by bounded queues. An idle worker keeps the reader
+busy while the filter queue has room, and otherwise takes the queued stage with the largest
+backlog per active worker, so workers drift toward the bottleneck stage. A stage whose output
+queue is full is not scheduled (backpressure). -sw caps the number of concurrent workers of
+the filter and thread stages; 0 leaves a stage uncapped.
+*/
+template <typename ValueType>
+class AlignPool {
+public:
+	Counts& counts;
+	task_pool_t pool;
+	vector<worker_t> workers;
+	uint64_t readsPerBatch, subBatchSize, minSubBatchSize, maxSubBatchSize, maxInflight, queueSize;
+	uint64_t nReadBytes = 0, nBufferedReads = 0; // guarded by rmtx
+	std::mutex rmtx, wmtx, smtx;
+	std::atomic<bool> eof{false};
+	std::atomic<uint64_t> ninflight{0};
+	uint64_t nextRead = 0, nextWrite = 0; // sequence numbers of the next sub-batch to read/write
+	map<uint64_t, batch_t<ValueType>*> pending; // finished sub-batches waiting for their turn to be written
+	// stage bookkeeping, guarded by smtx
+	std::deque<batch_t<ValueType>*> queues[N_STAGE]; // input queue of each stage
+	int nactive[N_STAGE] = {}, maxactive[N_STAGE] = {}, cap[N_STAGE];
+	uint64_t nbatch[N_STAGE] = {}, nread[N_STAGE] = {};
+	double busy[N_STAGE] = {}, cpu[N_STAGE] = {}; // sec; cpu only with -mx
+	// -mx only, guarded by wmtx
+	bool metrics;
+	batch_metrics_t mx;
+	std::chrono::steady_clock::time_point tStart, tLastEmit;
+	std::atomic<bool> perfWarned{false};
+	// -ab/-eb only, guarded by wmtx
+	uint64_t chunkOffset = 0; // bytes handed to the writer so far
+	vector<std::pair<uint64_t, uint64_t>> chunks; // compressed offset and size of each sub-batch
+	vector<vector<uint32_t>> locusChunks; // chunk ids of each destination locus
+	// -ck only
+	uint64_t outBytes; // guarded by wmtx
+	uint64_t outStart; // outBytes when this run started
+	std::streamoff inStart; // input offset of the first read of this run
+	bool ckptDue = false, ckptTaper = false; // guarded by rmtx
+	uint64_t ckptWritten = 0, ckptDrain = 0; // sub-batches written before the last checkpoint and in flight when it was due, guarded by rmtx
+	std::chrono::steady_clock::time_point tLastCkpt;
+	std::thread ckptThread;
+	std::atomic<bool> ckptBusy{false};
+	// memory report, guarded by rmtx
+	uint64_t peakPairingBytes = 0, peakBatchBytes = 0;
+	std::atomic<uint64_t> batchBytes{0};
+
+	AlignPool(Counts& counts_, int nproc) : counts(counts_), pool(nproc), workers(pool.size()) {
+		metrics = counts.metricsOut != nullptr;
+		tStart = tLastEmit = tLastCkpt = std::chrono::steady_clock::now();
+		outBytes = outStart = counts.outBytes;
+		inStart = std::max<std::streamoff>(0, counts.in->tellg());
+		readsPerBatch = 300000 * counts.readsPerBatchFactor;
+		subBatchSize = std::max<uint64_t>(2, readsPerBatch / SUB_BATCHES / 2 * 2);
+		minSubBatchSize = std::min<uint64_t>(subBatchSize, MIN_SUB_BATCH);
+		maxSubBatchSize = subBatchSize * 4;
+		maxInflight = (pool.size() + 1) * SUB_BATCHES;
+		queueSize = maxInflight / 2;
+		if (counts.readMemBudget) { // -mb: before reads are measured, assume BUDGET_READ_BYTES per read
+			uint64_t size = std::max<uint64_t>(2, counts.readMemBudget / 2 / maxInflight / BUDGET_READ_BYTES / 2 * 2);
+			if (size < subBatchSize) {
+				cerr << "sub-batch size " << subBatchSize << " -> " << size << " reads (memory budget)" << endl;
+				subBatchSize = size;
+				readsPerBatch = size * SUB_BATCHES;
+				minSubBatchSize = std::min(minSubBatchSize, size);
+			}
+		}
+		cap[STAGE_READ] = 1;
+		cap[STAGE_FILTER] = counts.filterWorkers ? counts.filterWorkers : pool.size();
+		cap[STAGE_THREAD] = counts.threadWorkers ? counts.threadWorkers : pool.size();
+		cap[STAGE_WRITE] = 1;
+		for (uint64_t i = 0; i < workers.size(); ++i) {
+			worker_t& w = workers[i];
+			w.kmerDBi = counts.kmerDBi;
+			w.kmerDBi_vv = counts.kmerDBi_vv;
+			w.graphDB = counts.graphDB;
+			if (counts.numaCpus) {
+				w.node = i % counts.numaCpus->size();
+				if (w.node) {
+					rpgg_replica_t& r = (*counts.replicas)[w.node - 1];
+					w.kmerDBi = &r.kmerDBi;
+					w.kmerDBi_vv = &r.kmerDBi_vv;
+					w.graphDB = &r.graphDB;
+				}
+			}
+			w.hits1.assign(counts.nloci+1, 0);
+			w.hits2.assign(counts.nloci+1, 0);
+			if (counts.locusCost) { w.lcost.resize(counts.nloci); }
+			if (counts.locusQC) { w.lqc.resize(counts.nloci); }
+			if (not counts.skip1) {
+				w.dupcache.init(counts.dupCacheSize);
+				w.tdupcache.init(counts.dupCacheSize);
+			}
+		}
+		if (counts.alnBinary or counts.readBinary) { // the header gets its own BGZF block so chunks can be read on their own
+			string hdr;
+			if (counts.alnBinary) { bgzf_compress(string(ALNBIN_MAGIC, 8), hdr, counts.bgzfLevel); }
+			else {
+				string h(READBIN_MAGIC, 8);
+				putU64(h, counts.nloci);
+				h += (char)counts.isFastq;
+				bgzf_compress(h, hdr, counts.bgzfLevel);
+			}
+			chunkOffset = hdr.size();
+			counts.writer->push(hdr);
+			locusChunks.resize(counts.nloci + counts.alnBinary); // -ab: dst == nloci is not aligned (-a)
+		}
+	}
+
+	// -ck: restore the state saved in counts.ckptFname and move the input to the first unread read;
+	// false if there is no checkpoint. Called before run().
+	bool Resume() {
+		checkpoint_t ck;
+		if (not ck.read(counts.ckptFname)) { return false; }
+		if (ck.args != counts.ckptArgs) {
+			cerr << "ERROR " << counts.ckptFname << " was written with different options:\n  " << ck.args << '\n'
+			     << "Remove it to start over." << endl;
+			exit(1);
+		}
+		assert(ck.nmapread.size() == counts.nloci and ck.kmc.size() == counts.nloci);
+		uint64_t* stats[N_CKPT_STAT];
+		CkptStats(stats);
+		for (int i = 0; i < N_CKPT_STAT; ++i) { *stats[i] = ck.stats[i]; }
+		if (counts.isFastq) {
+			for (uint64_t i = 0; i + 2 < ck.mates.size(); i += 3) { (*counts.fqDB)[ck.mates[i]] = std::make_pair(ck.mates[i+1], ck.mates[i+2]); }
+		}
+		else {
+			for (uint64_t i = 0; i + 1 < ck.mates.size(); i += 2) { (*counts.readDB)[ck.mates[i]] = ck.mates[i+1]; }
+		}
+		for (uint64_t i = 0; i < counts.nloci; ++i) {
+			(*counts.nmapread)[i] = ck.nmapread[i];
+			(*counts.kmc)[i] = ck.kmc[i];
+		}
+		restoreCounts(ck.tr, *counts.trResults);
+		if (counts.invkmer) { restoreCounts(ck.inv, *counts.ikmerDB); }
+		if (counts.outputBubbles) { restoreCounts(ck.bubbles, *counts.bubbleDB); }
+		counts.in->seekg(ck.inOffset);
+		assert(*counts.in);
+		inStart = ck.inOffset;
+		outBytes = outStart = ck.outBytes;
+		cerr << "resumed from " << counts.ckptFname << " at input byte " << ck.inOffset << " after " << *counts.nReads << " reads. "
+		     << "STDOUT continues the first " << ck.outBytes << " bytes of the previous run's STDOUT" << endl;
+		return true;
+	}
+
+	// .aln.bin.idx or .reads.bin.idx, see alnbin.h
+	void writeChunkIndex(string fn, const char* magic) {
+		ofstream fout(fn, std::ios::binary);
+		assert(fout);
+		uint64_t nloci = locusChunks.size(), nchunks = chunks.size(), off = 0;
+		fout.write(magic, 8);
+		fout.write((char*)&nloci, 8);
+		fout.write((char*)&nchunks, 8);
+		for (auto& c : chunks) {
+			fout.write((char*)&c.first, 8);
+			fout.write((char*)&c.second, 8);
+		}
+		for (auto& v : locusChunks) {
+			fout.write((char*)&off, 8);
+			off += v.size();
+		}
+		fout.write((char*)&off, 8);
+		for (auto& v : locusChunks) { fout.write((char*)v.data(), v.size() * sizeof(uint32_t)); }
+		fout.close();
+	}
+
+	// merge the per-worker profiles after run()
+	void writeLocusCost(string fn) {
+		vector<locus_cost_t> lcost(counts.nloci);
+		for (worker_t& w : workers) {
+			for (uint64_t i = 0; i < w.lcost.size(); ++i) {
+				lcost[i].npair += w.lcost[i].npair;
+				lcost[i].ncorr += w.lcost[i].ncorr;
+				lcost[i].nfail += w.lcost[i].nfail;
+				lcost[i].sec += w.lcost[i].sec;
+			}
+		}
+		::writeLocusCost(fn, lcost);
+	}
+
+	// per-worker tables, peak read buffers and the pairing hash, after run()
+	void memReport(mem_report_t& rep) {
+		uint64_t tables = 0, dup = 0;
+		for (worker_t& w : workers) {
+			tables += vecBytes(w.hits1) + vecBytes(w.hits2) + vecBytes(w.lcost) + vecBytes(w.lqc) + vecBytes(w.bubbles.v) + vecBytes(w.cakmers);
+			dup += w.dupcache.bytes() + w.tdupcache.bytes();
+		}
+		rep.add("per-thread tables", tables);
+		if (dup) { rep.add("dup caches", dup); }
+		rep.add("read batches (peak)", peakBatchBytes);
+		rep.add("pairing hash (peak)", peakPairingBytes);
+	}
+
+	// merge the per-worker statistics after run()
+	void writeLocusQC(string fn) {
+		vector<locus_qc_t> qc(counts.nloci);
+		for (worker_t& w : workers) {
+			for (uint64_t i = 0; i < w.lqc.size(); ++i) { qc[i].add(w.lqc[i]); }
+		}
+		::writeLocusQC(fn, qc, *counts.trResults, *counts.graphDB, counts.locusSel);
+	}
+
+	~AlignPool() { if (ckptThread.joinable()) { ckptThread.join(); } }
+
+	// -bu: once no sub-batch is in flight
+	void MergeBubbles() {
+		vector<bubble_buf_t*> bufs;
+		for (worker_t& w : workers) { bufs.push_back(&w.bubbles); }
+		mergeBubbles(bufs, *counts.bubbleDB, workers.size());
+	}
+
+	void run() {
+		pool.run([this](int wid) { return Schedule(wid); });
+		if (ckptThread.joinable()) { ckptThread.join(); }
+		if (counts.outputBubbles) { MergeBubbles(); }
+		if (metrics) { EmitMetrics(true); }
+		cerr << pool.nStolen() << " sub-batches stolen between workers" << endl;
+		for (int s = 0; s < N_STAGE; ++s) {
+			cerr << "stage " << stageNames[s] << ": " << nbatch[s] << " sub-batches, " << busy[s] << " sec busy, "
+			     << maxactive[s] << '/' << cap[s] << " max/cap workers" << endl;
+		}
+	}
+
+private:
+	static const uint64_t SUB_BATCHES = 8; // sub-batches per batch of readsPerBatch reads
+	static const uint64_t MIN_SUB_BATCH = 1000; // reads
+	static constexpr double TARGET_SEC = 1.0; // targeted parse+filter+threading time per sub-batch
+	static const uint64_t BUDGET_READ_BYTES = 1000; // -mb: assumed memory per read before it is measured
+
+	int Schedule(int wid);
+	int NextStage();
+	bool ReadBatch(int wid);
+	bool Checkpoint();
+	void CkptStats(uint64_t* stats[N_CKPT_STAT]) {
+		uint64_t* s[N_CKPT_STAT] = { counts.nReads, counts.nThreadingReads, counts.nFeasibleReads, counts.nAsgnReads, counts.nSubFiltered,
+		                             counts.nKmerFiltered, counts.nBaitFiltered, counts.nLocusAssignFiltered, counts.nDupLookup, counts.nDupHit };
+		std::copy(s, s + N_CKPT_STAT, stats);
+	}
+	void AdaptBatchSize();
+	bool PerfOn(worker_t& w);
+	void Pin(worker_t& w) {
+		if (counts.numaCpus and not w.pinned) {
+			w.pinned = true;
+			if (not pinToCpus((*counts.numaCpus)[w.node])) { cerr << "[Warning] cannot pin a worker to NUMA node " << w.node << endl; }
+		}
+	}
+	void FilterBatch(worker_t& w, batch_t<ValueType>& b);
+	void ThreadBatch(worker_t& w, batch_t<ValueType>& b);
+	void FormatBatch(batch_t<ValueType>& b);
+	void WriteBatch(batch_t<ValueType>* b);
+	void EmitMetrics(bool final);
+	void Begin(int stage);
+	void End(int stage, const stage_timer_t& t, uint64_t n, uint64_t nr, batch_t<ValueType>* b, int next);
+};
+
+template <typename ValueType>
+void AlignPool<ValueType>::Begin(int stage) {
+	std::lock_guard<std::mutex> lk(smtx);
+	maxactive[stage] = std::max(maxactive[stage], ++nactive[stage]);
+}
+
+// release the stage slot after n sub-batches of nr reads and, unless next is N_STAGE, queue b for the next stage
+template <typename ValueType>
+void AlignPool<ValueType>::End(int stage, const stage_timer_t& t, uint64_t n, uint64_t nr, batch_t<ValueType>* b, int next) {
+	double sec = t.wallSec(), csec = t.cpuSec();
+	{
+		std::lock_guard<std::mutex> lk(smtx);
+		--nactive[stage];
+		nbatch[stage] += n;
+		nread[stage] += nr;
+		busy[stage] += sec;
+		cpu[stage] += csec;
+		if (next != N_STAGE) { queues[next].push_back(b); }
+	}
+	pool.wake();
+}
+
+// must be called from the thread owning w
+template <typename ValueType>
+bool AlignPool<ValueType>::PerfOn(worker_t& w) {
+	if (not counts.perfCounters) { return false; }
+	if (not w.perfTried) {
+		w.perfTried = true;
+		if (not w.perf.open() and not perfWarned.exchange(true)) {
+			cerr << "[Warning] hardware performance counters unavailable (" << strerror(w.perf.err) << "); -pc disabled" << endl;
+		}
+	}
+	return w.perf.opened();
+}
+
+// pick the queued stage with the largest backlog per active worker; downstream wins ties
+template <typename ValueType>
+int AlignPool<ValueType>::NextStage() {
+	int best = -1;
+	double bestScore = 0;
+	for (int s = STAGE_THREAD; s >= STAGE_FILTER; --s) {
+		if (queues[s].empty() or nactive[s] >= cap[s]) { continue; }
+		if (s == STAGE_FILTER and queues[STAGE_THREAD].size() + nactive[STAGE_FILTER] >= queueSize) { continue; }
+		double score = (double)queues[s].size() / (nactive[s] + 1);
+		if (score > bestScore) {
+			best = s;
+			bestScore = score;
+		}
+	}
+	return best;
+}
+
+// Called by idle workers, see task_pool_t::run
+template <typename ValueType>
+int AlignPool<ValueType>::Schedule(int wid) {
+	Pin(workers[wid]);
+	bool readable;
+	{
+		std::lock_guard<std::mutex> lk(smtx);
+		readable = queues[STAGE_FILTER].size() < queueSize;
+	}
+	if (readable) {
+		stage_timer_t t(false);
+		bool pushed = ReadBatch(wid);
+		workers[wid].busyNs += t.wallSec() * 1e9;
+		if (pushed) { return task_pool_t::REFILL_PUSHED; }
+	}
+
+	std::lock_guard<std::mutex> lk(smtx);
+	int s = NextStage();
+	if (s < 0) {
+		if (eof and ninflight == 0) { return task_pool_t::REFILL_DONE; }
+		return task_pool_t::REFILL_BUSY;
+	}
+	batch_t<ValueType>* b = queues[s].front();
+	queues[s].pop_front();
+	maxactive[s] = std::max(maxactive[s], ++nactive[s]); // reserved here so that caps hold while the task is queued
+	pool.push(wid, [this, s, b](int wid_) {
+		stage_timer_t t(metrics);
+		worker_t& w = workers[wid_];
+		Pin(w);
+		if (s == STAGE_FILTER) { FilterBatch(w, *b); }
+		else if (PerfOn(w)) {
+			perf_counts_t c0, c1, c2;
+			w.perf.read(c0);
+			ThreadBatch(w, *b);
+			w.perf.read(c1);
+			FormatBatch(*b);
+			w.perf.read(c2);
+			b->mx.perf[PHASE_THREAD].add(c0, c1);
+			b->mx.perf[PHASE_OUTPUT].add(c1, c2);
+		}
+		else {
+			ThreadBatch(w, *b);
+			FormatBatch(*b);
+		}
+		if (s == STAGE_FILTER) { End(s, t, 1, b->nReads, b, STAGE_THREAD); }
+		else {
+			End(s, t, 1, b->nReads, b, N_STAGE);
+			WriteBatch(b);
+		}
+		workers[wid_].busyNs += t.wallSec() * 1e9;
+	});
+	return task_pool_t::REFILL_PUSHED;
+}
+
+// MemAvailable in /proc/meminfo, 0 if unknown
+inline uint64_t memAvailable() {
+	ifstream fin("/proc/meminfo");
+	string key, unit;
+	uint64_t kb;
+	while (fin >> key >> kb >> unit) {
+		if (key == "MemAvailable:") { return kb * 1024; }
+	}
+	return 0;
+}
+
+// -ck: called by the reader with rmtx held. Once writing the in-flight sub-batches would take until
+// the checkpoint is due, at most one batch (SUB_BATCHES) is kept in flight; when it is due and no
+// more than that is left, reading pauses until the rest is written. The counts are then copied while
+// all workers are idle and written to disk by a background thread, so workers only wait for the
+// drain of one batch and the copy.
+template <typename ValueType>
+bool AlignPool<ValueType>::Checkpoint() {
+	if (not ckptDue) {
+		if (ckptBusy) { return true; } // the previous checkpoint is still being written
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - tLastCkpt).count();
+		if (not ckptTaper) {
+			uint64_t nwritten = nextRead - ninflight - ckptWritten;
+			double drainSec = nwritten ? elapsed / nwritten * ninflight : 0; // at the write rate since the last checkpoint
+			ckptTaper = elapsed + drainSec >= counts.ckptInterval;
+		}
+		if (not ckptTaper) { return true; }
+		if (elapsed < counts.ckptInterval or ninflight > SUB_BATCHES) { return ninflight < SUB_BATCHES; } // a late estimate delays the checkpoint, not the workers
+		ckptDue = true;
+		ckptDrain = ninflight;
+	}
+	if (ninflight) { return false; }
+
+	stage_timer_t t(false);
+	checkpoint_t* ck = new checkpoint_t;
+	ck->args = counts.ckptArgs;
+	ck->inOffset = counts.in->tellg();
+	{
+		std::lock_guard<std::mutex> lk(wmtx);
+		ck->outBytes = outBytes;
+	}
+	uint64_t* stats[N_CKPT_STAT];
+	CkptStats(stats);
+	for (int i = 0; i < N_CKPT_STAT; ++i) { ck->stats[i] = *stats[i]; }
+	for (auto& p : *counts.readDB) {
+		ck->mates.push_back(p.first);
+		ck->mates.push_back(p.second);
+	}
+	for (auto& p : *counts.fqDB) {
+		ck->mates.push_back(p.first);
+		ck->mates.push_back(p.second.first);
+		ck->mates.push_back(p.second.second);
+	}
+	ck->nmapread.assign(counts.nmapread->begin(), counts.nmapread->end());
+	ck->kmc.assign(counts.kmc->begin(), counts.kmc->end());
+	copyNonzeroCounts(ck->tr, *counts.trResults);
+	if (counts.invkmer) { copyNonzeroCounts(ck->inv, *counts.ikmerDB); }
+	if (counts.outputBubbles) {
+		MergeBubbles();
+		copyNonzeroCounts(ck->bubbles, *counts.bubbleDB);
+	}
+	cerr << "checkpoint at input byte " << ck->inOffset << " (" << *counts.nReads << " reads, " << ckptDrain << " sub-batches drained) copied in " << t.wallSec() << " sec" << endl;
+
+	ckptDue = ckptTaper = false;
+	ckptWritten = nextRead;
+	tLastCkpt = std::chrono::steady_clock::now();
+	if (ckptThread.joinable()) { ckptThread.join(); }
+	ckptBusy = true;
+	ckptThread = std::thread([this, ck]() {
+		counts.writer->sync(ck->outBytes - outStart); // the output must reach outBytes before the checkpoint does
+		ck->write(counts.ckptFname);
+		delete ck;
+		ckptBusy = false;
+	});
+	return true;
+}
+
+// Called by the reader before each sub-batch. The sub-batch size targets TARGET_SEC of measured
+// parse+filter+threading time, is capped so that maxInflight sub-batches fit in a quarter of the
+// available memory (half of what -mb leaves after loading), and shrinks near EOF so that the last sub-batches are spread over all workers.
+// Sizes stay within [minSubBatchSize, maxSubBatchSize]; -fb keeps the initial size.
+template <typename ValueType>
+void AlignPool<ValueType>::AdaptBatchSize() {
+	if (counts.fixedBatchSize) { return; }
+	double parse, comp;
+	{
+		std::lock_guard<std::mutex> lk(smtx);
+		if (nread[STAGE_THREAD] < minSubBatchSize) { return; } // not measured yet
+		parse = nread[STAGE_READ] ? busy[STAGE_READ] / nread[STAGE_READ] : 0;
+		comp = (busy[STAGE_FILTER] + busy[STAGE_THREAD]) / nread[STAGE_THREAD];
+	}
+	uint64_t size = parse + comp > 0 ? TARGET_SEC / (parse + comp) : maxSubBatchSize;
+	const char* reason = "throughput";
+
+	uint64_t avail = memAvailable() / 4;
+	if (counts.readMemBudget) { avail = avail ? std::min(avail, counts.readMemBudget / 2) : counts.readMemBudget / 2; }
+	double memPerRead = (double)nReadBytes / nBufferedReads + 3*sizeof(string);
+	if (avail and avail / maxInflight / memPerRead < size) {
+		size = avail / maxInflight / memPerRead;
+		reason = counts.readMemBudget ? "memory budget" : "memory";
+	}
+
+	std::streamoff pos = counts.in->tellg();
+	if (counts.inSize and pos > 0 and pos <= counts.inSize) {
+		double inBytesPerRead = (double)(pos - inStart) / nBufferedReads;
+		uint64_t tail = (counts.inSize - pos) / inBytesPerRead / (2*pool.size());
+		if (tail < size) {
+			size = tail;
+			reason = "near EOF";
 		}
+	}
 
-		while (nReads_ < readsPerBatch and in->peek() != EOF) {
-			if (isFastq) {
+	if (size > maxSubBatchSize) {
+		size = maxSubBatchSize;
+		reason = "upper bound";
+	}
+	else if (size < minSubBatchSize) {
+		size = minSubBatchSize;
+		reason = "lower bound";
+	}
+	size = size / 2 * 2;
+	if (size * 5 < subBatchSize * 4 or size * 5 > subBatchSize * 6) { // changed by >20%
+		cerr << "sub-batch size " << subBatchSize << " -> " << size << " reads (" << reason << "; "
+		     << parse*1e6 << " us/read parsing, " << comp*1e6 << " us/read filtering+threading)" << endl;
+		subBatchSize = size;
+		readsPerBatch = size * SUB_BATCHES;
+	}
+}
+
+// Only one worker reads at a time; each sub-batch is queued as soon as it is filled so that
+// the other workers can filter it while the rest of the batch is read.
+template <typename ValueType>
+bool AlignPool<ValueType>::ReadBatch(int wid) {
+	if (eof or ninflight >= maxInflight) { return false; }
+	if (not rmtx.try_lock()) { return false; }
+	if (eof or (counts.ckptInterval > 0 and not Checkpoint())) { rmtx.unlock(); return false; }
+	Begin(STAGE_READ);
+	stage_timer_t t(metrics);
+
+	bool isFastq = counts.isFastq;
+	int simmode = counts.simmode;
+	const uint64_t nloci = counts.nloci;
+	const uint64_t minReadSize = counts.Cthreshold + ksize - 1;
+	const uint64_t shard = counts.shard, nshard = counts.nshard;
+	uint64_t& nReads = *counts.nReads;
+	ifstream *in = counts.in;
+	readbin_reader_t* rbin = counts.readBin;
+	auto more = [&]() { return rbin ? not rbin->eof() : in->peek() != EOF; };
+	unordered_map<string, string>& readDB = *counts.readDB;
+	unordered_map<string, std::pair<string,string>>& fqDB = *counts.fqDB;
+	string title, title1, seq, seq1, qtitle, qtitle1, qual, qual1;
+	uint64_t nBatchReads = 0, npushed = 0;
+
+	while (nBatchReads < readsPerBatch and ninflight < maxInflight and not (ckptTaper and ninflight >= SUB_BATCHES) and more()) {
+		{
+			std::lock_guard<std::mutex> lk(smtx);
+			if (queues[STAGE_FILTER].size() >= queueSize) { break; }
+		}
+		AdaptBatchSize();
+		batch_t<ValueType>* b = new batch_t<ValueType>(nextRead, subBatchSize);
+		vector<string>& titles = b->titles;
+		vector<string>& seqs = b->seqs;
+		vector<string>& quals = b->quals;
+		uint64_t& nReads_ = b->nReads;
+		uint64_t nReadBytes0 = nReadBytes;
+
+		while (nReads_ < subBatchSize and more()) {
+			if (rbin) { // -rb: pairs and their loci from pass 1
+				uint64_t locus;
+				readbin_pair_t rp;
+				if (not rbin->next(title, seq, seq1, qual, qual1, locus, rp)) { break; }
+				if (nshard > 1 and readShard(title, nshard) != shard) { continue; }
+				b->destLoci[nReads_/2] = locus;
+				b->rbpairs.push_back(rp);
+				titles[nReads_] = title;
+				seqs[nReads_] = seq;
+				quals[nReads_++] = qual;
+				titles[nReads_] = title;
+				seqs[nReads_] = seq1;
+				quals[nReads_++] = qual1;
+				nReadBytes += 2*title.size() + seq.size() + seq1.size() + qual.size() + qual1.size();
+			}
+			else if (isFastq) {
 				bool se = true; // single end
 				while (se) {
 					getline(*in, title);
@@ -1830,6 +2705,10 @@ void CountWords(void *data) {
 					getline(*in, qtitle);
 					getline(*in, qual);
 					prunePEinfo(title);
+					if (nshard > 1 and readShard(title, nshard) != shard) {
+						if (in->peek() == EOF) { break; }
+						continue;
+					}
 					auto it = fqDB.find(title);
 					if (it != fqDB.end()) {
 						if (seq.size() < minReadSize or it->second.first.size() < minReadSize) { fqDB.erase(title); continue; }
@@ -1844,8 +2723,10 @@ void CountWords(void *data) {
 					}
 					if (in->peek() == EOF) { break; }
 				}
-				if (simmode == 1) { parseReadName(title, nReads_, srcLoci, locusReadi); }
-				else if (simmode == 2) { parseReadName(title, meta, nloci); }
+				if (se and in->peek() == EOF) { break; }
+
+				if (simmode == 1) { parseReadName(title, nReads_, b->srcLoci, b->locusReadi); }
+				else if (simmode == 2) { parseReadName(title, b->meta, nloci); }
 
 				titles[nReads_] = title;
 				seqs[nReads_] = seq;
@@ -1853,6 +2734,7 @@ void CountWords(void *data) {
 				titles[nReads_] = title1; // XXX TODO redundant. only title is enough
 				seqs[nReads_] = seq1;
 				quals[nReads_++] = qual1;
+				nReadBytes += 2*title.size() + seq.size() + seq1.size() + qual.size() + qual1.size();
 			}
 			else {
 				bool se = true; // single end
@@ -1860,6 +2742,10 @@ void CountWords(void *data) {
 					getline(*in, title);
 					getline(*in, seq);
 					prunePEinfo(title);
+					if (nshard > 1 and readShard(title, nshard) != shard) {
+						if (in->peek() == EOF) { break; }
+						continue;
+					}
 					auto it = readDB.find(title);
 					if (it != readDB.end()) {
 						if (seq.size() < minReadSize or it->second.size() < minReadSize) { readDB.erase(title); continue; }
@@ -1875,296 +2761,692 @@ void CountWords(void *data) {
 				}
 				if (se and in->peek() == EOF) { break; }
 
-				if (simmode == 1) { parseReadName(title, nReads_, srcLoci, locusReadi); }
-				else if (simmode == 2) { parseReadName(title, meta, nloci); }
+				if (simmode == 1) { parseReadName(title, nReads_, b->srcLoci, b->locusReadi); }
+				else if (simmode == 2) { parseReadName(title, b->meta, nloci); }
 
 				titles[nReads_] = title;
 				seqs[nReads_++] = seq;
 				titles[nReads_] = title1; // XXX TODO redundant. only title is enough
 				seqs[nReads_++] = seq1;
+				nReadBytes += 2*title.size() + seq.size() + seq1.size();
 			}
-		} 
-		nReads += nReads_;
-
-		if (simmode == 1) { locusReadi.push_back(nReads_); }
-		if (skip1) { parseReadNames(titles, destLoci, nReads_); } // XXX obsolete
-
-		cerr << "Buffered reading " << nReads_ << '\t' << nReads << '\t' << readDB.size()+fqDB.size() << endl;
-
-		//
-		// All done reading, release the thread lock.
-		//
-		sem_post(semreader);
-
-		time_t time2 = time(nullptr);
-		uint64_t seqi = 0;
-		uint64_t nhash0 = 0, nhash1 = 0;
-		uint64_t destLocus, destLocus0; // filtered/raw destLocus
-		bubbles_t bubbles;
-		// aln only
-		vector<sam_t> sams;
-		// simmode only
-		vector<km_asgn_t> kams;
-		uint64_t simi = 0;
-		ValueType srcLocus = -1;
-		if (simmode == 1) { srcLocus = srcLoci[simi]; }
-
-		while (seqi < nReads_) {
-
-			vector<uint64_t> kmers1, kmers2;
-			vector<kmerIndex_uint32_umap::iterator> its1, its2;
-			vector<PE_KMC> dup;
-			log_t log;
-			int rm1 = 0, rm2 = 0; // 1 = removed by any filter
-			int kf1 = 0, kf2 = 0; // 1 = removed by kfilter
-			int hf1 = 0, hf2 = 0; // 1 = removed by countHit
-			int bf1 = 0, bf2 = 0; // 1 = removed by bfilter
-			int af1 = 0, af2 = 0; // 1 = removed by assignTRkmc
-			int nm1, nm2; // num of exact kmer matches at assigned locus BEFORE early stopping
-
-			if (simmode == 1) {
-				if (seqi >= locusReadi[simi]) {
-					++simi;
-					srcLocus = srcLoci[simi];
+		}
+		if (nReads_ == 0) { delete b; break; }
+		nBatchReads += nReads_;
+		nBufferedReads += nReads_;
+		b->memBytes = nReadBytes - nReadBytes0 + 3*subBatchSize*sizeof(string);
+		peakBatchBytes = std::max<uint64_t>(peakBatchBytes, batchBytes += b->memBytes);
+
+		if (simmode == 1) { b->locusReadi.push_back(nReads_); }
+
+		++nextRead;
+		++ninflight;
+		++npushed;
+		{
+			std::lock_guard<std::mutex> lk(smtx);
+			queues[STAGE_FILTER].push_back(b);
+		}
+		pool.wake();
+	}
+	nReads += nBatchReads;
+	if (not more()) { eof = true; }
+	if (nBufferedReads) {
+		uint64_t npending = readDB.size() + fqDB.size();
+		peakPairingBytes = std::max<uint64_t>(peakPairingBytes, umapBytes(readDB) + umapBytes(fqDB) + npending * (nReadBytes / nBufferedReads));
+	}
+
+	if (npushed) { cerr << "Buffered reading " << nBatchReads << '\t' << nReads << '\t' << readDB.size()+fqDB.size() << endl; }
+	End(STAGE_READ, t, npushed, nBatchReads, nullptr, N_STAGE);
+	rmtx.unlock();
+	return npushed;
+}
+
+template <typename ValueType>
+void AlignPool<ValueType>::FilterBatch(worker_t& w, batch_t<ValueType>& b) {
+	bool threading = counts.threading;
+	bool g2pan = counts.g2pan;
+	bool skip1 = counts.skip1; // -rb: step 1 was done by -eb
+	int simmode = counts.simmode;
+	uint16_t Cthreshold = counts.Cthreshold;
+	const uint64_t nloci = counts.nloci;
+	kmerIndex_uint32_umap& kmerDBi = *w.kmerDBi;
+	vector<uint32_t>& kmerDBi_vv = *w.kmerDBi_vv;
+	vector<uint64_t>& locusmap = *counts.locusmap;
+	const vector<bool>* locusSel = counts.locusSel;
+	vector<uint32_t>& hits1 = w.hits1;
+	vector<uint32_t>& hits2 = w.hits2;
+	dup_cache_t& dupcache = w.dupcache;
+	// per-batch outputs and statistics
+	vector<string>& titles = b.titles;
+	vector<string>& seqs = b.seqs;
+	vector<ValueType>& srcLoci = b.srcLoci;
+	vector<uint64_t>& locusReadi = b.locusReadi;
+	vector<std::pair<int, uint64_t>>& meta = b.meta;
+	vector<uint64_t>& destLoci = b.destLoci;
+	uint64_t& nShort_ = b.nShort;
+	uint64_t& nSubFiltered_ = b.nSubFiltered;
+	uint64_t& nKmerFiltered_ = b.nKmerFiltered;
+	uint64_t& nLocusAssignFiltered_ = b.nLocusAssignFiltered;
+	uint64_t& nhash0 = b.nhash0;
+	uint64_t& nhash1 = b.nhash1;
+	const uint64_t nReads_ = b.nReads;
+
+	b.time2 = time(nullptr);
+	uint64_t nDupLookup0 = dupcache.nlookup, nDupHit0 = dupcache.nhit;
+	// -pc: countHit is measured per pair, everything else in this stage counts as kfilter
+	bool perf = PerfOn(w);
+	perf_counts_t pc0, pc1;
+	if (perf) { w.perf.read(pc0); }
+	// -qc: a pair that reached countHit
+	auto qcHit = [&](uint64_t locus0, uint64_t locus, int nkf) {
+		if (not counts.locusQC or locus0 >= nloci) { return; }
+		locus_qc_t& q = w.lqc[locus0];
+		++q.nhit;
+		q.nkf += nkf;
+		q.nassigned += locus != nloci;
+	};
+	uint64_t seqi = 0;
+	uint64_t destLocus0; // raw destLocus
+	uint64_t simi = 0;
+	ValueType srcLocus = -1;
+	if (simmode == 1) { srcLocus = srcLoci[simi]; }
+	while (seqi < nReads_) {
+
+		vector<uint64_t> kmers1, kmers2;
+		vector<kmerIndex_uint32_umap::iterator> its1, its2;
+		vector<PE_KMC> dup;
+		log_t log;
+		int rm1 = 0, rm2 = 0; // 1 = removed by any filter
+		int kf1 = 0, kf2 = 0; // 1 = removed by kfilter
+		int hf1 = 0, hf2 = 0; // 1 = removed by countHit
+		int nm1, nm2; // num of exact kmer matches at assigned locus BEFORE early stopping
+
+		if (simmode == 1) {
+			if (seqi >= locusReadi[simi]) {
+				++simi;
+				srcLocus = srcLoci[simi];
+			}
+		}
+		else if (simmode == 2) { mapLocus(g2pan, meta, locusmap, seqi, simi, nloci, srcLocus); }
+
+		string& seq = seqs[seqi++];
+		string& seq1 = seqs[seqi++];
+
+		dup_entry_t* de = nullptr;
+		bool dhit = false;
+		if (dupcache.enabled()) { de = dupcache.probe(seq, seq1, dhit); }
+
+		if (dhit) {
+			kf1 = de->kf1; kf2 = de->kf2;
+			hf1 = de->hf1; hf2 = de->hf2;
+			if      (de->stage == DUP_SHORT) { ++nShort_; continue; }
+			else if (de->stage == DUP_SUB)   { nSubFiltered_ += 2; continue; }
+			nKmerFiltered_ += kf1 + kf2;
+			nLocusAssignFiltered_ += hf1 + hf2;
+			if (de->stage == DUP_KF) {
+				if (hf1 or hf2) { qcHit(de->destLocus0, nloci, kf1 + kf2); }
+				continue;
+			}
+			rm1 = de->rm1; rm2 = de->rm2;
+			nm1 = de->nm1; nm2 = de->nm2;
+			destLocus0 = de->destLocus0;
+			destLoci[seqi/2 - 1] = de->destLocus;
+			if (not threading) {
+				kmers1 = de->kmers1;
+				kmers2 = de->kmers2;
+			}
+		}
+		else if (not skip1) {
+			read2kmers(kmers1, seq, ksize); // stores numeric canonical kmers
+			read2kmers(kmers2, seq1, ksize);
+			if (metrics) {
+				b.mx.kmersPerRead.add(kmers1.size());
+				b.mx.kmersPerRead.add(kmers2.size());
+			}
+			if (not kmers1.size() or not kmers2.size()) { 
+				++nShort_;
+				if (de) { de->filtered(DUP_SHORT, 0, 0, 0, 0); }
+				if (verbosity >= 3) {
+					log.m << titles[seqi-2] << ' ' << seq  << '\n'
+						  << titles[seqi-1] << ' ' << seq1 << '\n';
 				}
+				continue; 
+			}
+			if (N_FILTER and NM_FILTER) {
+				if (subfilter(kmers1, kmers2, kmerDBi, nhash0)) { // both ends have to pass
+					nSubFiltered_ += 2;
+					if (de) { de->filtered(DUP_SUB, 0, 0, 0, 0); }
+					//if (simmode) { f1.add(srcLocus, nloci); }
+					continue;
+				}
+			}
+			kfilter(kmers1, kmers2, its1, its2, kmerDBi, Cthreshold, nhash1, kf1, kf2, rm1, rm2);
+			nKmerFiltered_ += kf1 + kf2;
+			if (rm1 and rm2) {
+				if (de) { de->filtered(DUP_KF, kf1, kf2, 0, 0); }
+				continue;
 			}
-			else if (simmode == 2) { mapLocus(g2pan, meta, locusmap, seqi, simi, nloci, srcLocus); }
-
-			string& seq = seqs[seqi];
-			string& qual = quals[seqi++];
-			string& seq1 = seqs[seqi];
-			string& qual1 = quals[seqi++];
 
-			if (not skip1) {
-				read2kmers(kmers1, seq, ksize); // stores numeric canonical kmers
-				read2kmers(kmers2, seq1, ksize);
-				if (not kmers1.size() or not kmers2.size()) { 
-					++nShort_;
-					if (verbosity >= 3) {
-						log.m << titles[seqi-2] << ' ' << seq  << '\n'
-							  << titles[seqi-1] << ' ' << seq1 << '\n';
-					}
-					continue; 
+			uint32_t ncand = 0;
+			if (perf) {
+				w.perf.read(pc1);
+				b.mx.perf[PHASE_KFILTER].add(pc0, pc1);
+			}
+			destLoci[seqi/2 - 1] = countHit(kmerDBi_vv, its1, its2, hits1, hits2, dup, nloci, Cthreshold, log, destLocus0, nm1, nm2, hf1, hf2, rm1, rm2, metrics ? &ncand : nullptr);
+			if (locusSel and destLoci[seqi/2 - 1] != nloci and not (*locusSel)[destLoci[seqi/2 - 1]]) { destLoci[seqi/2 - 1] = nloci; } // -lo: not loaded
+			if (perf) {
+				w.perf.read(pc0);
+				b.mx.perf[PHASE_COUNTHIT].add(pc1, pc0);
+			}
+			if (metrics) { b.mx.lociPerPair.add(ncand); }
+			nLocusAssignFiltered_ += hf1 + hf2;
+			if (de) {
+				if (destLoci[seqi/2 - 1] == nloci) {
+					de->filtered(DUP_KF, kf1, kf2, hf1, hf2);
+					de->destLocus0 = destLocus0;
 				}
-				if (N_FILTER and NM_FILTER) {
-					if (subfilter(kmers1, kmers2, kmerDBi, nhash0)) { // both ends have to pass
-						nSubFiltered_ += 2;
-						//if (simmode) { f1.add(srcLocus, nloci); }
-						continue;
+				else {
+					de->filtered(DUP_ASGN, kf1, kf2, hf1, hf2);
+					de->rm1 = rm1; de->rm2 = rm2;
+					de->nm1 = nm1; de->nm2 = nm2;
+					de->destLocus = destLoci[seqi/2 - 1];
+					de->destLocus0 = destLocus0;
+					if (not threading) {
+						de->kmers1 = kmers1;
+						de->kmers2 = kmers2;
 					}
 				}
-				kfilter(kmers1, kmers2, its1, its2, kmerDBi, Cthreshold, nhash1, kf1, kf2, rm1, rm2);
-				nKmerFiltered_ += kf1 + kf2;
-				if (rm1 and rm2) { continue; }
-
-				destLoci[seqi/2 - 1] = countHit(kmerDBi_vv, its1, its2, hits1, hits2, dup, nloci, Cthreshold, log, destLocus0, nm1, nm2, hf1, hf2, rm1, rm2);
-				nLocusAssignFiltered_ += hf1 + hf2;
 			}
+		}
+		else { // -rb: restore the step 1 results of -eb
+			readbin_pair_t& rp = b.rbpairs[seqi/2 - 1];
+			destLocus0 = rp.locus0;
+			kf1 = (rp.flags & READBIN_KF1) != 0; kf2 = (rp.flags & READBIN_KF2) != 0;
+			hf1 = (rp.flags & READBIN_HF1) != 0; hf2 = (rp.flags & READBIN_HF2) != 0;
+			rm1 = (rp.flags & READBIN_RM1) != 0; rm2 = (rp.flags & READBIN_RM2) != 0;
+			nm1 = nm2 = 0;
+			if (not threading) {
+				read2kmers(kmers1, seq, ksize);
+				read2kmers(kmers2, seq1, ksize);
+			}
+		}
 
-			destLocus = destLoci[seqi/2 - 1];
-			if (destLocus == nloci) { continue; }
-
-			bool alned = false;
-			int alned0 = 0, alned1 = 0;
-			kmerCount_umap cakmers;
-			sam_t sam;
-			km_asgn_t kam;
-			vector<uint64_t> noncakmers0, noncakmers1;
-			vector<uint64_t> akmers0, akmers1; // aligned kmers
-			GraphType& gf = graphDB[destLocus];
-			nThreadingReads_ += 2;
+		qcHit(destLocus0, destLoci[seqi/2 - 1], kf1 + kf2);
+		if (destLoci[seqi/2 - 1] == nloci) { continue; }
+
+		b.pairs.emplace_back();
+		pair_state_t<ValueType>& ps = b.pairs.back();
+		ps.seqi = seqi;
+		ps.srcLocus = srcLocus;
+		ps.destLocus0 = destLocus0;
+		ps.rm1 = rm1; ps.rm2 = rm2;
+		ps.kf1 = kf1; ps.kf2 = kf2;
+		ps.hf1 = hf1; ps.hf2 = hf2;
+		ps.dhit = dhit;
+		if (not threading) {
+			ps.kmers1 = std::move(kmers1);
+			ps.kmers2 = std::move(kmers2);
+		}
+	}
+	b.nDupLookup = dupcache.nlookup - nDupLookup0;
+	b.nDupHit = dupcache.nhit - nDupHit0;
+	if (perf) {
+		w.perf.read(pc1);
+		b.mx.perf[PHASE_KFILTER].add(pc0, pc1);
+	}
+}
 
-			if (threading) {
+template <typename ValueType>
+void AlignPool<ValueType>::ThreadBatch(worker_t& w, batch_t<ValueType>& b) {
+	bool outputBubbles = counts.outputBubbles;
+	bool bait = counts.bait;
+	bool threading = counts.threading;
+	bool correction = counts.correction;
+	bool tc = counts.tc;
+	bool aln = counts.aln;
+	bool aln_minimal = counts.aln_minimal;
+	bool invkmer = counts.invkmer;
+	bool dedup = counts.dedup;
+	int simmode = counts.simmode;
+	int countMode = counts.countMode;
+	int extractFastX = counts.extractFastX;
+	uint16_t thread_cth = counts.thread_cth;
+	const uint64_t nloci = counts.nloci;
+	vector<GraphType>& graphDB = *w.graphDB;
+	vector<kmer_aCount_umap>& trResults = *counts.trResults;
+	vector<kmer_aCount_umap>& ikmerDB = *counts.ikmerDB;
+	vector<atomic_uint32_t>& nmapread = *counts.nmapread;
+	vector<atomic_uint64_t>& kmc = *counts.kmc;
+	//bait_db_t& baitDB = *counts.baitDB;
+	bait_fps_db_t& baitDB = *counts.baitDB;
+	dup_cache_t& tdupcache = w.tdupcache;
+	// per-batch outputs and statistics
+	vector<string>& seqs = b.seqs;
+	vector<string>& quals = b.quals;
+	vector<uint64_t>& destLoci = b.destLoci;
+	vector<uint64_t>& extractindices = b.extractindices;
+	vector<uint64_t>& assignedloci = b.assignedloci;
+	vector<uint64_t>& alnindices = b.alnindices;
+	vector<sam_t>& sams = b.sams;
+	vector<km_asgn_t>& kams = b.kams;
+	uint64_t& nThreadingReads_ = b.nThreadingReads;
+	uint64_t& nFeasibleReads_ = b.nFeasibleReads;
+	uint64_t& nAsgnReads_ = b.nAsgnReads;
+	uint64_t& nBaitFiltered_ = b.nBaitFiltered;
+
+	for (pair_state_t<ValueType>& ps : b.pairs) {
+		uint64_t seqi = ps.seqi;
+		ValueType srcLocus = ps.srcLocus;
+		uint64_t destLocus0 = ps.destLocus0; // raw destLocus
+		uint64_t destLocus = destLoci[seqi/2 - 1];
+		int rm1 = ps.rm1, rm2 = ps.rm2; // 1 = removed by any filter
+		int kf1 = ps.kf1, kf2 = ps.kf2; // 1 = removed by kfilter
+		int hf1 = ps.hf1, hf2 = ps.hf2; // 1 = removed by countHit
+		int bf1 = 0, bf2 = 0; // 1 = removed by bfilter
+		int af1 = 0, af2 = 0; // 1 = removed by assignTRkmc
+		bool dhit = ps.dhit;
+		vector<uint64_t>& kmers1 = ps.kmers1;
+		vector<uint64_t>& kmers2 = ps.kmers2;
+		log_t log;
+		string& seq = seqs[seqi-2];
+		string& qual = quals[seqi-2];
+		string& seq1 = seqs[seqi-1];
+		string& qual1 = quals[seqi-1];
+
+		bool alned = false;
+		int alned0 = 0, alned1 = 0;
+		vector<uint64_t>& cakmers = w.cakmers; // sorted canonical kmers of the pair
+		cakmers.clear();
+		sam_t sam;
+		km_asgn_t kam;
+		vector<uint64_t> noncakmers0, noncakmers1;
+		vector<uint64_t> akmers0, akmers1; // aligned kmers
+		GraphType& gf = graphDB[destLocus];
+		nThreadingReads_ += 2;
+
+		if (threading) {
+			dup_entry_t* de = nullptr;
+			bool thit = false;
+			if (tdupcache.enabled()) { de = tdupcache.probe(seq, seq1, thit); }
+			if (thit and de->threaded) {
+				alned0 = de->alned0;
+				alned1 = de->alned1;
+				noncakmers0 = de->noncakmers0;
+				noncakmers1 = de->noncakmers1;
+				akmers0 = de->akmers0;
+				akmers1 = de->akmers1;
+				sam.r1 = de->r1;
+				sam.r2 = de->r2;
+			}
+			else {
+				uint64_t natt0 = 0, natt1 = 0;
+				bool natt = metrics or counts.locusCost;
+				stage_timer_t t(false);
 				sam.init1(seq);
-				alned0 = isThreadFeasible(gf, seq, noncakmers0, akmers0, thread_cth, correction, sam.r1, trResults[destLocus], log);
+				alned0 = isThreadFeasible(gf, seq, noncakmers0, akmers0, thread_cth, correction, sam.r1, trResults[destLocus], log, natt ? &natt0 : nullptr);
 				sam.init2(seq1);
-				alned1 = isThreadFeasible(gf, seq1, noncakmers1, akmers1, thread_cth, correction, sam.r2, trResults[destLocus], log);
+				alned1 = isThreadFeasible(gf, seq1, noncakmers1, akmers1, thread_cth, correction, sam.r2, trResults[destLocus], log, natt ? &natt1 : nullptr);
+				if (metrics) {
+					b.mx.corrPerRead.add(natt0);
+					b.mx.corrPerRead.add(natt1);
+				}
+				if (counts.locusCost) {
+					locus_cost_t& lc = w.lcost[destLocus];
+					++lc.npair;
+					lc.sec += t.wallSec();
+					lc.ncorr += natt0 + natt1;
+					lc.nfail += (alned0 == 0) + (alned1 == 0);
+				}
 				if (tc) {
 					if (alned0) { threadCheck(gf, seq, akmers0, sam.r1, log); }
 					if (alned1) { threadCheck(gf, seq1, akmers1, sam.r2, log); }
 				}
-				if (verbosity >= 1) { log.m << "Reads passed threading? " << alned0 << alned1 << '\n'; }
-				if (alned0 or alned1) {
-					alned = true;
-					noncaVec2CaUmap(noncakmers0, cakmers, ksize);
-					noncaVec2CaUmap(noncakmers1, cakmers, ksize);
+				if (de) {
+					de->threaded = true;
+					de->alned0 = alned0;
+					de->alned1 = alned1;
+					de->noncakmers0 = noncakmers0;
+					de->noncakmers1 = noncakmers1;
+					de->akmers0 = akmers0;
+					de->akmers1 = akmers1;
+					de->r1 = sam.r1;
+					de->r2 = sam.r2;
 				}
-				else { destLocus = nloci; } // removed by threading
 			}
+			if (verbosity >= 1) { log.m << "Reads passed threading? " << alned0 << alned1 << '\n'; }
+			if (alned0 or alned1) {
+				alned = true;
+				if (counts.locusQC) {
+					locus_qc_t& q = w.lqc[destLocus];
+					++q.nthreaded;
+					if (alned0) { q.addThread(sam.r1); }
+					if (alned1) { q.addThread(sam.r2); }
+				}
+				noncaVec2CaVec(noncakmers0, cakmers, ksize);
+				noncaVec2CaVec(noncakmers1, cakmers, ksize);
+				std::sort(cakmers.begin(), cakmers.end());
+			}
+			else { destLocus = nloci; } // removed by threading
+		}
 
-			if ((threading and alned) or not threading) {
-				kmer_aCount_umap &trKmers = trResults[destLocus];
-				kmer_aCount_umap &ikmers = ikmerDB[destLocus];
-				nFeasibleReads_ += 2;
-				nmapread[destLocus] += 2;
+		if ((threading and alned) or not threading) {
+			kmer_aCount_umap &trKmers = trResults[destLocus];
+			kmer_aCount_umap &ikmers = ikmerDB[destLocus];
+			bool dcount = not (dhit and dedup); // -dd: duplicate pairs are counted once
+			nFeasibleReads_ += 2;
+			if (dcount) { nmapread[destLocus] += 2; }
 
-				if (extractFastX) {
-					// points to the next read pair 
-					// i.e. to_be_extract_forward (seqi-2), to_be_extract_reverse (seqi-1)
-					extractindices.push_back(seqi); 
-					if (extractFastX == 2) {
-						assignedloci.push_back(destLocus);
-					}
+			if (extractFastX) {
+				// points to the next read pair 
+				// i.e. to_be_extract_forward (seqi-2), to_be_extract_reverse (seqi-1)
+				extractindices.push_back(seqi); 
+				if (extractFastX == 2) {
+					assignedloci.push_back(destLocus);
 				}
-				else {
-					// accumulate trKmers for output
-					if (not threading) {
-						if (bait) {
-							auto& baitdb = baitDB[destLocus];
-							bfilter_FPSv1(baitdb, seq, qual, bf1, qth);
-							bfilter_FPSv1(baitdb, seq1, qual1, bf2, qth);
-							if (bf1 or bf2) {
-								nBaitFiltered_ += (bf1 & !rm1) + (bf2 & !rm2);
-								rm1 = 1;
-								rm2 = 1;
-							}
+				if (counts.readBinary) { b.rbpairs.emplace_back(destLocus0, kf1, kf2, hf1, hf2, rm1, rm2); }
+			}
+			else {
+				// accumulate trKmers for output
+				if (not threading) {
+					if (bait) {
+						auto& baitdb = baitDB[destLocus];
+						bfilter_FPSv1(baitdb, seq, qual, bf1, qth);
+						bfilter_FPSv1(baitdb, seq1, qual1, bf2, qth);
+						if (bf1 or bf2) {
+							nBaitFiltered_ += (bf1 & !rm1) + (bf2 & !rm2);
+							if (counts.locusQC) { w.lqc[destLocus].nbait += (bf1 & !rm1) + (bf2 & !rm2); }
+							rm1 = 1;
+							rm2 = 1;
 						}
+					}
 
-						if (countMode == 2) { // asgn
-							int npass = 2 - rm1 - rm2;
-							if (not rm1) { assignTRkmc(kmers1, trKmers, gf, kam.r1, af1, rm1); }
-							if (not rm2) { assignTRkmc(kmers2, trKmers, gf, kam.r2, af2, rm2); }
-							if (rm1 and rm2) { destLocus = nloci; } // removed by TR_kmer_assignment
-							else {
-								nAsgnReads_ += npass - af1 - af2;
+					if (countMode == 2) { // asgn
+						int npass = 2 - rm1 - rm2;
+						if (not rm1) { assignTRkmc(kmers1, trKmers, gf, kam.r1, af1, rm1); }
+						if (not rm2) { assignTRkmc(kmers2, trKmers, gf, kam.r2, af2, rm2); }
+						if (rm1 and rm2) { destLocus = nloci; } // removed by TR_kmer_assignment
+						else {
+							nAsgnReads_ += npass - af1 - af2;
+							if (counts.locusQC) { w.lqc[destLocus].nasgn += npass - af1 - af2; }
+							if (dcount) {
 								nmapread[destLocus] += (npass - af1 - af2);
 								kmc[destLocus] += (kam.r1.ei - kam.r1.si) + (kam.r2.ei - kam.r2.si);
 							}
-							if ((srcLocus != nloci and srcLocus != -1ULL) or destLocus != nloci) {
-								kam.assign(srcLocus, destLocus, destLocus0);
-								kam.r1.assign(kf1, hf1, bf1, af1, rm1);
-								kam.r2.assign(kf2, hf2, bf2, af2, rm2);
-								kams.push_back(kam);
-								alnindices.push_back(seqi);
-							}
+						}
+						if ((srcLocus != nloci and srcLocus != -1ULL) or destLocus != nloci) {
+							kam.assign(srcLocus, destLocus, destLocus0);
+							kam.r1.assign(kf1, hf1, bf1, af1, rm1);
+							kam.r2.assign(kf2, hf2, bf2, af2, rm2);
+							kams.push_back(kam);
+							alnindices.push_back(seqi);
 						}
 					}
-					else {
-						//if (bait) {
-						//    auto& baitdb = baitDB[destLocus];
-						//    if (not rm1) { bfilter(baitdb, akmers0, nm1, bf1); }
-						//    if (not rm2) { bfilter(baitdb, akmers1, nm2, bf2); }
-						//	if (bf1 and bf2) {
-						//		nBaitFiltered_ += 2;
-						//		continue;
+				}
+				else {
+					//if (bait) {
+					//    auto& baitdb = baitDB[destLocus];
+					//    if (not rm1) { bfilter(baitdb, akmers0, nm1, bf1); }
+					//    if (not rm2) { bfilter(baitdb, akmers1, nm2, bf2); }
+					//	if (bf1 and bf2) {
+					//		nBaitFiltered_ += 2;
+					//		continue;
+					//	}
+					//}
+
+					if (invkmer and dcount) { addSortedKmers(cakmers, ikmers); }
+					if (countMode == 0 and dcount) { addSortedKmers(cakmers, trKmers); } // exact
+					else { // aln or asgn
+						if (countMode == 1 and dcount) { // aln
+							size_t n = cakmers.size();
+							noncaVec2CaVec(akmers0, cakmers, ksize);
+							noncaVec2CaVec(akmers1, cakmers, ksize);
+							std::sort(cakmers.begin() + n, cakmers.end());
+							std::inplace_merge(cakmers.begin(), cakmers.begin() + n, cakmers.end());
+							addSortedKmers(cakmers, trKmers);
+						}
+						//else { // asgn XXX not supported yet
+						//	vector<uint64_t> cakmers1, cakmers2;
+						//	nonckmer2ckmer(akmers0, cakmers1, ksize);
+						//	nonckmer2ckmer(akmers1, cakmers1, ksize);
+
+						//	if (not bf1) { assignTRkmc(cakmers1, trKmers, gf, kam.r1, af1, rm1); }
+						//	if (not bf2) { assignTRkmc(cakmers2, trKmers, gf, kam.r2, af2, rm2); }
+						//	nAsgnReads_ += 2 - af1 - af2;
+						//	nmapread[destLocus] += (2 - af1 - af2);
+						//	kmc[destLocus] += (kam.r1.ei - kam.r1.si) + (kam.r2.ei - kam.r2.si);
+						//	if (rm1 and rm2) { destLocus = nloci; } // removed by TR_kmer_assignment
+						//	if ((srcLocus != nloci and srcLocus != -1ULL) or destLocus != nloci) {
+						//		kam.assign(srcLocus, destLocus);
+						//		alnindices.push_back(seqi);
+						//		kams.push_back(kam);
 						//	}
 						//}
-
-						if (invkmer) {
-							for (auto& p : cakmers) {
-								auto it = ikmers.find(p.first);
-								if (it != ikmers.end()) { it->second += p.second; }
-							}
-						}
-						if (countMode == 0) { // exact
-							for (auto& p : cakmers) {
-								auto it = trKmers.find(p.first);
-								if (it != trKmers.end()) { it->second += p.second; }
-							}
-						}
-						else { // aln or asgn
-							if (countMode == 1) { // aln
-								noncaVec2CaUmap(akmers0, cakmers, ksize);
-								noncaVec2CaUmap(akmers1, cakmers, ksize);
-								for (auto& p : cakmers) {
-									auto it = trKmers.find(p.first);
-									if (it != trKmers.end()) { it->second += p.second; }
-								}
-							}
-							//else { // asgn XXX not supported yet
-							//	vector<uint64_t> cakmers1, cakmers2;
-							//	nonckmer2ckmer(akmers0, cakmers1, ksize);
-							//	nonckmer2ckmer(akmers1, cakmers1, ksize);
-
-							//	if (not bf1) { assignTRkmc(cakmers1, trKmers, gf, kam.r1, af1, rm1); }
-							//	if (not bf2) { assignTRkmc(cakmers2, trKmers, gf, kam.r2, af2, rm2); }
-							//	nAsgnReads_ += 2 - af1 - af2;
-							//	nmapread[destLocus] += (2 - af1 - af2);
-							//	kmc[destLocus] += (kam.r1.ei - kam.r1.si) + (kam.r2.ei - kam.r2.si);
-							//	if (rm1 and rm2) { destLocus = nloci; } // removed by TR_kmer_assignment
-							//	if ((srcLocus != nloci and srcLocus != -1ULL) or destLocus != nloci) {
-							//		kam.assign(srcLocus, destLocus);
-							//		alnindices.push_back(seqi);
-							//		kams.push_back(kam);
-							//	}
-							//}
-						}
 					}
+				}
 
-					if (outputBubbles) {
-						countNovelEdges(noncakmers0, graphDB[destLocus], bubbles[destLocus]);
-						countNovelEdges(noncakmers1, graphDB[destLocus], bubbles[destLocus]);
-					}
+				if (outputBubbles and dcount) {
+					bubble_sink_t bu{w.bubbles, (uint32_t)destLocus};
+					countNovelEdges(noncakmers0, graphDB[destLocus], bu);
+					countNovelEdges(noncakmers1, graphDB[destLocus], bu);
 				}
 			}
+		}
 
-			if (aln and threading) {
-				if (not simmode) {
-					if ((aln_minimal and destLocus != nloci) or (not aln_minimal)) {
-						alnindices.push_back(seqi); // work the same as extractindices
-						sam.src = srcLocus;
-						sam.dst = destLocus;
-						sams.push_back(sam);
-					}
-				} else { // simmode
-					if ((aln_minimal and (srcLocus != nloci or destLocus != nloci)) or (not aln_minimal)) {
-						alnindices.push_back(seqi); // work the same as extractindices
-						sam.src = srcLocus;
-						sam.dst = destLocus;
-						sams.push_back(sam);
-					}
+		if (aln and threading) {
+			if (not simmode) {
+				if ((aln_minimal and destLocus != nloci) or (not aln_minimal)) {
+					alnindices.push_back(seqi); // work the same as extractindices
+					sam.src = srcLocus;
+					sam.dst = destLocus;
+					sams.push_back(sam);
+				}
+			} else { // simmode
+				if ((aln_minimal and (srcLocus != nloci or destLocus != nloci)) or (not aln_minimal)) {
+					alnindices.push_back(seqi); // work the same as extractindices
+					sam.src = srcLocus;
+					sam.dst = destLocus;
+					sams.push_back(sam);
 				}
 			}
 		}
+	}
+}
 
-		// write reads or alignments to STDOUT
-		// begin thread lock
-		sem_wait(semwriter); 
+// format STDOUT content outside of any lock
+template <typename ValueType>
+void AlignPool<ValueType>::FormatBatch(batch_t<ValueType>& b) {
+	bool isFastq = counts.isFastq;
+	bool aln = counts.aln;
+	bool skip1 = counts.skip1;
+	int extractFastX = counts.extractFastX;
+	vector<string>& titles = b.titles;
+	vector<string>& seqs = b.seqs;
+	vector<string>& quals = b.quals;
+	ostringstream out;
+
+	writeKmerAssignments(out, seqs, titles, b.destLoci, b.alnindices, b.kams);
+	if (extractFastX or aln) {
+		if (extractFastX and not counts.readBinary) {
+			if (isFastq) { writeExtractedReads(out, extractFastX, seqs, quals, titles, b.extractindices, b.assignedloci); }
+			else         { writeExtractedReads(out, extractFastX, seqs, titles, b.extractindices, b.assignedloci); }
+		}
+		else if (aln and not counts.alnBinary) {
+			if (skip1) { writeAlignments(out, seqs, titles, b.alnindices, b.sams); }
+			else { writeAlignments(out, seqs, titles, b.destLoci, b.alnindices, b.sams); }
+		}
+	}
+	if (aln and counts.alnBinary) {
+		string bin;
+		encodeAlignments(bin, seqs, titles, b.alnindices, b.sams, b.chunkLoci);
+		bgzf_compress(bin, b.out, counts.bgzfLevel);
+	}
+	else if (counts.readBinary) {
+		string bin;
+		encodeReadPairs(bin, seqs, quals, titles, b.extractindices, b.assignedloci, b.rbpairs, isFastq, b.chunkLoci);
+		bgzf_compress(bin, b.out, counts.bgzfLevel);
+	}
+	else if (counts.bgzfLevel >= 0) { bgzf_compress(out.str(), b.out, counts.bgzfLevel); }
+	else { b.out = out.str(); }
+}
 
-		writeKmerAssignments(seqs, titles, destLoci, alnindices, kams);
-		if (extractFastX or aln) {
-			if (extractFastX) {
-				if (isFastq) { writeExtractedReads(extractFastX, seqs, quals, titles, extractindices, assignedloci); }
-				else         { writeExtractedReads(extractFastX, seqs, titles, extractindices, assignedloci); }
-			}
-			else if (aln) {
-				if (skip1) { writeAlignments(seqs, titles, alnindices, sams); }
-				else { writeAlignments(seqs, titles, destLoci, alnindices, sams); }
+// One JSON object per line; called with wmtx held or after the pool has finished.
+// Stage wall/cpu times are summed over workers, so they can exceed the elapsed time.
+template <typename ValueType>
+void AlignPool<ValueType>::EmitMetrics(bool final) {
+	ostream& out = *counts.metricsOut;
+	auto now = std::chrono::steady_clock::now();
+	double elapsed = std::chrono::duration<double>(now - tStart).count();
+	tLastEmit = now;
+
+	out << "{\"elapsed\":" << elapsed << ",\"final\":" << (final ? "true" : "false")
+	    << ",\"reads\":" << nread[STAGE_READ] << ",\"stages\":{";
+	{
+		std::lock_guard<std::mutex> lk(smtx);
+		for (int s = 0; s < N_STAGE; ++s) {
+			out << (s ? "," : "") << '"' << stageNames[s] << "\":{\"batches\":" << nbatch[s] << ",\"reads\":" << nread[s]
+			    << ",\"wall\":" << busy[s] << ",\"cpu\":" << cpu[s] << ",\"active\":" << nactive[s]
+			    << ",\"queued\":" << queues[s].size() << '}';
+		}
+	}
+	out << "},\"threads\":[";
+	for (uint64_t i = 0; i < workers.size(); ++i) {
+		double busySec = workers[i].busyNs * 1e-9;
+		out << (i ? "," : "") << "{\"busy\":" << busySec << ",\"util\":" << (elapsed > 0 ? busySec / elapsed : 0) << '}';
+	}
+	out << "],\"hist\":{\"kmers_per_read\":";
+	mx.kmersPerRead.write(out);
+	out << ",\"loci_per_pair\":";
+	mx.lociPerPair.write(out);
+	out << ",\"corrections_per_read\":";
+	mx.corrPerRead.write(out);
+	out << '}';
+	if (counts.perfCounters and not perfWarned) {
+		out << ",\"perf\":{";
+		for (int i = 0; i < N_PHASE; ++i) {
+			out << (i ? "," : "") << '"' << phaseNames[i] << "\":";
+			mx.perf[i].write(out);
+		}
+		out << '}';
+	}
+	out << '}' << endl;
+}
+
+// Sub-batches finish out of order; they are handed to the writer thread strictly by sequence
+// number so that the output is identical to a single-threaded run.
+template <typename ValueType>
+void AlignPool<ValueType>::WriteBatch(batch_t<ValueType>* b) {
+	uint64_t nwritten = 0, nwrittenReads = 0;
+	{
+		std::lock_guard<std::mutex> lk(wmtx);
+		stage_timer_t t(metrics);
+		pending[b->bi] = b;
+		if (pending.begin()->first == nextWrite) { Begin(STAGE_WRITE); }
+		while (pending.size() and pending.begin()->first == nextWrite) {
+			b = pending.begin()->second;
+			pending.erase(pending.begin());
+			++nextWrite;
+			++nwritten;
+			nwrittenReads += b->nReads;
+
+			if ((counts.alnBinary or counts.readBinary) and b->out.size()) {
+				for (uint32_t l : b->chunkLoci) { locusChunks[l].push_back(chunks.size()); }
+				chunks.emplace_back(chunkOffset, b->out.size());
+				chunkOffset += b->out.size();
 			}
+			outBytes += b->out.size();
+			counts.writer->push(b->out);
+			if (metrics) { mx.merge(b->mx); }
+
+			*counts.nThreadingReads += b->nThreadingReads;
+			*counts.nFeasibleReads += b->nFeasibleReads;
+			*counts.nAsgnReads += b->nAsgnReads;
+			*counts.nSubFiltered += b->nSubFiltered;
+			*counts.nKmerFiltered += b->nKmerFiltered;
+			*counts.nBaitFiltered += b->nBaitFiltered;
+			*counts.nLocusAssignFiltered += b->nLocusAssignFiltered;
+			*counts.nDupLookup += b->nDupLookup;
+			*counts.nDupHit += b->nDupHit;
+
+			cerr << "Batch query in " << (time(nullptr) - b->time2) << " sec. " << 
+			        b->nShort << '/' <<
+			        (float)b->nhash0/b->nReads << '/' <<
+			        (float)b->nhash1/(b->nReads - b->nSubFiltered) << '/' <<
+			        b->nSubFiltered << '/' <<
+			        b->nKmerFiltered << '/' <<
+					b->nLocusAssignFiltered << '/' <<
+			        b->nThreadingReads << '/' <<
+			        b->nFeasibleReads << '/' <<
+			        b->nBaitFiltered << '/' <<
+			        b->nAsgnReads << endl;
+			batchBytes -= b->memBytes;
+			delete b;
+		}
+		if (nwritten) { End(STAGE_WRITE, t, nwritten, nwrittenReads, nullptr, N_STAGE); }
+		if (metrics and std::chrono::duration<double>(std::chrono::steady_clock::now() - tLastEmit).count() >= counts.metricsInterval) {
+			EmitMetrics(false);
 		}
-		if (outputBubbles) { accumBubbles(bubbles, bubbleDB); }
+	}
+	if (nwritten) {
+		ninflight -= nwritten;
+		pool.wake(); // the reader may be waiting for in-flight sub-batches to drain
+	}
+}
 
-		cerr << "Batch query in " << (time(nullptr) - time2) << " sec. " << 
-		        nShort_ << '/' <<
-		        (float)nhash0/nReads_ << '/' <<
-		        (float)nhash1/(nReads_ - nSubFiltered_) << '/' <<
-		        nSubFiltered_ << '/' <<
-		        nKmerFiltered_ << '/' <<
-				nLocusAssignFiltered_ << '/' <<
-		        nThreadingReads_ << '/' <<
-		        nFeasibleReads_ << '/' <<
-		        nBaitFiltered_ << '/' <<
-		        nAsgnReads_ << endl;
 
-		sem_post(semwriter);
-		//
-		// end of thread lock
+// -mb
+const double DENSE_LOAD_FACTOR = 4;
+const uint64_t MIN_READ_BUDGET = 64 << 20;
+
+// -mb: a lower bound of the memory taken by the index and graphs, from the sizes of their cereal
+// archives (u64 count, then raw pairs of 16 and 9 bytes): a malloc chunk and a bucket per kmer
+uint64_t minLoadBytes(string pref, bool index, bool graph) {
+	uint64_t n = 0;
+	if (index) { n += fileBytes(pref + ".kmerDBi.umap") / 16 * (mallocChunk(16 + 8) + 8) + fileBytes(pref + ".kmerDBi.vv"); }
+	if (graph) { n += fileBytes(pref + ".graph.umap") / 9 * (mallocChunk(16 + 8) + 8); }
+	return n;
+}
+
+// -ms: one sample per line, "INPUT OUT_PREFIX"; empty lines and lines starting with '#' are skipped
+void readManifest(string fn, vector<std::pair<string, string>>& samples) {
+	ifstream fin(fn);
+	assert(fin);
+	string line, in, out;
+	while (getline(fin, line)) {
+		if (line.empty() or line[0] == '#') { continue; }
+		std::istringstream iss(line);
+		if (not (iss >> in >> out)) {
+			cerr << "ERROR invalid line in " << fn << ": " << line << endl;
+			exit(1);
+		}
+		if (not ifstream(in)) {
+			cerr << "ERROR cannot open " << in << " listed in " << fn << endl;
+			exit(1);
+		}
+		samples.emplace_back(in, out);
 	}
+	assert(samples.size());
 }
 
 
+#ifndef DANBING_TK_NO_MAIN // defined by bench/align_bench.cpp, which reuses the kernels above
 int main(int argc, char* argv[]) {
 
 	if (argc < 2) {
 		cerr << '\n'
-		     << "Usage: danbing-tk [-v] [-b] [-e] [-bu] [-g|-gc|-gcc] [-a|-ae] [-kf] [-cth] [-r] [-c] [-k] [-ik] [-p] <-o|-on> <-fa|-fq> -qs\n"
+		     << "Usage: danbing-tk [-v] [-b] [-e] [-bu] [-dc] [-dd] [-g|-gc|-gcc] [-a|-ae] [-kf] [-cth] [-r] [-fb] [-c] [-k] [-ik] [-p] [-sw] [-bgzf] [-mx] [-pc] [-lc] [-kb] [-ab] [-eb] [-ck] [-sh] [-lo] [-lb] <-o|-on> <-fa|-fq> -qs\n"
+		     << "       danbing-tk [options] <-ms <manifest>|-sv <socket>> -qs\n"
+		     << "       danbing-tk [options] <-o|-on> -rb <prefix> -qs\n"
 		     << "Options:\n"
 		     << "  -v <INT>              Verbosity: 0-3. [0]\n"
 			 << "  -b <STR>              read FP-specific kmers from file STR to remove FP reads.\n"
 		     << "  -e <INT>              Write mapped reads to STDOUT in fasta format.\n"
 		     << "                        Specify 1 for keeping original read names. Will not write .kmers output.\n"
-		     << "                        Specify 2 for appending assigned locus to each read name. Used to skip step1 for later queries.\n"
+		     << "                        Specify 2 for appending assigned locus to each read name. Use -eb to rerun step 2 on extracted reads.\n"
 		     << "  -bu                   Write read (k+1)-mers divergent from graph to .bub\n"
+		     << "  -dc <INT>             Cache the outcome of up to INT read pairs per thread and stage, keyed by read pair sequence. [0]\n"
+		     << "                        Duplicate pairs skip filtering, locus assignment and threading.\n"
+		     << "  -dd                   Count duplicate read pairs once. Requires -dc. Best effort: a duplicate is only found while\n"
+		     << "                        it is in the cache of the thread that gets it, so counts vary with -p and scheduling.\n"
 		     << "  -xg                   Use only kmer matches to assign read to locus, skip threading.\n"
 		     << "  -g <INT>              Use graph threading algorithm w/o error correction\n"
 		     << "  -gc <INT1> [INT2]     Use graph threading algorithm w/ error correction, the default algorithm.\n"
@@ -2180,7 +3462,9 @@ int main(int argc, char* argv[]) {
 		     << "  -cth <INT>            Discard both pe reads if maxhit of one pe read is below this threshold. [45]\n"
 		     << "                        Will skip read filtering and run threading directly if not specified.\n"
 			 << "  -qth <INT>            At baiting step, only consider kmers of which overlapping bases have qual score >= INT. [20]\n"
-		     << "  -r <FLOAT>            scaling factor for readsPerBatch. Can affect multiprocess efficiency. [1]\n"
+		     << "  -r <FLOAT>            scaling factor for the initial readsPerBatch. Can affect multiprocess efficiency. [1]\n"
+		     << "                        Batch sizes then adapt to the measured throughput, free memory and distance to EOF.\n"
+		     << "  -fb                   Keep readsPerBatch fixed.\n"
 		     << "  -c <STR>              Alternative kmer counting mode for .tr.kmers output: \"aln\" or \"asgn\"\n"
 		     << "                        Default counts exact kmer matches\n"
 		     << "                        aln: counts aligned kmers after applying CIGAR operations\n"
@@ -2190,8 +3474,48 @@ int main(int argc, char* argv[]) {
 		     << "  -ik                   Use .inv.kmers to record invariant kmer counts\n"
 		     << "  -k <INT>              Kmer size [21]\n"
 		     << "  -p <INT>              Use n threads. [1]\n"
+		     << "  -mx <STR> [INT]       Append run metrics as JSON lines to file STR every INT sec [10] and at the end.\n"
+		     << "                        Includes per-stage wall/cpu time, per-thread utilization and log2 histograms of\n"
+		     << "                        kmers per read, candidate loci per pair and correction attempts per read.\n"
+		     << "  -pc                   Add hardware counters (cycles, instructions, LLC and branch misses) of the kfilter,\n"
+		     << "                        countHit, threading and output phases to the -mx report. Needs perf_event_open access.\n"
+		     << "  -mb <FLOAT>           Memory budget in GB. Fails before loading if the RPGG cannot fit, stores the index and\n"
+		     << "                        graphs in denser hash tables if needed, and sizes read batches to what is left.\n"
+		     << "  -hp <thp|hugetlb>     Back the index and graphs with huge pages: thp collapses them into 2 MB transparent\n"
+		     << "                        huge pages after loading; hugetlb has malloc use reserved hugetlbfs pages (2 MB or 1 GB).\n"
+		     << "  -numa                 Copy the index and graphs to every NUMA node and pin each thread to a node.\n"
+		     << "  -lc                   Profile threading cost per locus and write loci sorted by total time to [-o].locus_cost.tsv\n"
+		     << "  -qc                   Write per-locus read pairs by filtering stage, TR/flank kmer depth and threading edit\n"
+		     << "                        rate to [-o].locus_qc. Not compatible with -ck.\n"
+		     << "  -bgzf <INT>           Compress reads/alignments written to STDOUT as BGZF at level INT (0-9).\n"
+		     << "  -sw <INT1> <INT2>     Max # of threads running the filter (INT1) and threading/counting (INT2) stages at once.\n"
+		     << "                        0 = no cap; idle threads are moved to the stage with the largest backlog. [0 0]\n"
 		     << "  -o <STR>              Output prefix\n"
 		     << "  -on <STR>             Same as the -o option, but write locus and kmer name as well\n"
+		     << "  -kb                   Write [-o].tr.kmers in the binary format of src/kmerbin.h, read by ktools sum,\n"
+		     << "                        danbing-tk-pred and vntrutils.readKms. Not compatible with -on.\n"
+		     << "  -ck <INT>             Checkpoint the counts to [-o].ckpt every INT sec. If [-o].ckpt exists, resume from it;\n"
+		     << "                        other options must be the same except -p and -sw. Needs -fa/-fq to be a file.\n"
+		     << "                        Not compatible with -ab, -eb or -dd.\n"
+		     << "  -ms <STR>             Manifest of samples, one \"INPUT OUT_PREFIX\" per line, replacing -fa/-fq and -o.\n"
+		     << "                        The RPGG is loaded once and the samples are processed one after another;\n"
+		     << "                        each gets OUT_PREFIX.* outputs and its STDOUT stream in OUT_PREFIX.(aln|aln.bin|fa|fq|kam)[.gz]\n"
+		     << "  -sv <STR>             Serve: keep the RPGG loaded and run jobs submitted over the Unix socket STR, one\n"
+		     << "                        at a time with all threads, with outputs named as for -ms. Requests, one per connection:\n"
+		     << "                        \"submit INPUT OUT_PREFIX\", \"status [JOB_ID]\", \"metrics\", \"shutdown\"\n"
+		     << "  -sh <INT1>/<INT2>     Only process read pairs whose name hashes to shard INT1 of INT2 (0-based).\n"
+		     << "                        Sum the outputs of all shards with `ktools merge-partials`.\n"
+		     << "  -ab                   Write the -a/-ae alignments to STDOUT in the block-compressed binary format of\n"
+		     << "                        src/alnbin.h (BGZF level from -bgzf [1]) and index them by locus in [-o].aln.bin.idx.\n"
+		     << "                        Read names are stored as fingerprints. Use `ktools view` to convert to text.\n"
+		     << "  -eb                   Step 1 only: write the read pairs assigned to a locus to STDOUT as read bins\n"
+		     << "                        (src/readbin.h, BGZF level from -bgzf [1]), indexed by locus in [-o].reads.bin.idx.\n"
+		     << "                        Save STDOUT as [-o].reads.bin for -rb.\n"
+		     << "  -rb <STR>             Step 2 only: thread and count the read bins STR.reads.bin of -eb instead of -fa/-fq.\n"
+		     << "                        Only the loci with reads (and in -lo) are loaded. Step 1 options have no effect.\n"
+		     << "  -lo <STR>             Only load the loci listed in STR, as 0-based locus ids (one per line) or BED\n"
+		     << "                        regions. Loci keep their original ids in all outputs; the other loci are empty.\n"
+		     << "  -lb <STR>             VNTR BED the RPGG was built from, one locus per line; maps the regions of -lo to loci\n"
 		     << "  -fa <STR>             Fasta file e.g. generated by samtools fasta -n\n"
 		     << "  -fq <STR>             Fastq file e.g. generated by samtools fastq -n\n"
 		     << "  -qs <STR>             Prefix for *.tr.kmers, *.ntr.kmers, *.graph.kmers files\n"
@@ -2203,10 +3527,15 @@ int main(int argc, char* argv[]) {
 	}
 
 	vector<string> args(argv, argv+argc);
-	bool bait = false, aug = false, threading = true, correction = true, tc = false, aln = false, aln_minimal=false, g2pan = false, skip1 = false, writeKmerName = false, outputBubbles = false, invkmer = false, isFastq = false;
-	int simmode = 0, extractFastX = 0, countMode = 0;
-	uint64_t argi = 1, trim = 0, thread_cth = 100, Cthreshold = 45, nproc = 1;
+	bool bait = false, dedup = false, fixedBatchSize = false, locusCost = false, locusQC = false, perfCounters = false, kmerBinary = false, alnBinary = false, readBinary = false, aug = false, threading = true, correction = true, tc = false, aln = false, aln_minimal=false, g2pan = false, skip1 = false, writeKmerName = false, outputBubbles = false, invkmer = false, isFastq = false;
+	int simmode = 0, extractFastX = 0, countMode = 0, bgzfLevel = -1;
+	uint64_t argi = 1, shard = 0, nshard = 1, trim = 0, thread_cth = 100, Cthreshold = 45, nproc = 1, dupCacheSize = 0, filterWorkers = 0, threadWorkers = 0;
 	float readsPerBatchFactor = 1;
+	double metricsInterval = 10, ckptInterval = 0, memBudgetGB = 0;
+	string hugepages; // -hp
+	bool numa = false;
+	string metricsFname, manifestFname, socketPath, lociFname, lociBedFname, readBinPrefix;
+	ofstream metricsFile;
 	string trPrefix, trFname, fastxFname, outPrefix, baitFname;
 	ifstream fastxFile, trFile, augFile, baitFile, mapFile;
 	ofstream outfile, baitOut;
@@ -2221,6 +3550,8 @@ int main(int argc, char* argv[]) {
 		else if (args[argi] == "-v") { verbosity = stoi(args[++argi]); }
 		else if (args[argi] == "-e") { extractFastX = stoi(args[++argi]); threading = false; }
 		else if (args[argi] == "-bu") { outputBubbles = true; }
+		else if (args[argi] == "-dc") { dupCacheSize = stoul(args[++argi]); }
+		else if (args[argi] == "-dd") { dedup = true; }
 		else if (args[argi] == "-t") { trim = stoi(args[++argi]); }
 		else if (args[argi] == "-s") { simmode = stoi(args[++argi]); }
 		else if (args[argi] == "-m") {
@@ -2242,6 +3573,34 @@ int main(int argc, char* argv[]) {
 			NM_FILTER = stoi(args[++argi]);
 		}
 		else if (args[argi] == "-r") { readsPerBatchFactor = stof(args[++argi]); }
+		else if (args[argi] == "-fb") { fixedBatchSize = true; }
+		else if (args[argi] == "-lc") { locusCost = true; }
+		else if (args[argi] == "-qc") { locusQC = true; }
+		else if (args[argi] == "-pc") { perfCounters = true; }
+		else if (args[argi] == "-kb") { kmerBinary = true; }
+		else if (args[argi] == "-ab") { alnBinary = true; }
+		else if (args[argi] == "-eb") { readBinary = true; extractFastX = 2; threading = false; }
+		else if (args[argi] == "-rb") { readBinPrefix = args[++argi]; skip1 = true; }
+		else if (args[argi] == "-ck") { ckptInterval = stof(args[++argi]); }
+		else if (args[argi] == "-ms") { manifestFname = args[++argi]; }
+		else if (args[argi] == "-sv") { socketPath = args[++argi]; }
+		else if (args[argi] == "-lo") { lociFname = args[++argi]; }
+		else if (args[argi] == "-lb") { lociBedFname = args[++argi]; }
+		else if (args[argi] == "-sh") {
+			string v = args[++argi];
+			size_t sep = v.find('/');
+			assert(sep != string::npos);
+			shard = stoul(v.substr(0, sep));
+			nshard = stoul(v.substr(sep+1));
+			assert(nshard >= 1 and shard < nshard);
+		}
+		else if (args[argi] == "-mb") { memBudgetGB = stod(args[++argi]); }
+		else if (args[argi] == "-hp") { hugepages = args[++argi]; }
+		else if (args[argi] == "-numa") { numa = true; }
+		else if (args[argi] == "-mx") {
+			metricsFname = args[++argi];
+			if (argi + 1 < argc and args[argi+1][0] != '-') { metricsInterval = stof(args[++argi]); }
+		}
 		else if (args[argi] == "-c") {
 			string v = args[++argi];
 			if (v == "aln") { countMode = 1; }
@@ -2293,6 +3652,14 @@ int main(int argc, char* argv[]) {
 			//}
 		}
 		else if (args[argi] == "-p") { nproc = stoi(args[++argi]); }
+		else if (args[argi] == "-bgzf") {
+			bgzfLevel = stoi(args[++argi]);
+			assert(bgzfLevel >= 0 and bgzfLevel <= 9);
+		}
+		else if (args[argi] == "-sw") {
+			filterWorkers = stoul(args[++argi]);
+			threadWorkers = stoul(args[++argi]);
+		}
 		else if (args[argi] == "-cth") { Cthreshold = stoi(args[++argi]); }
 		else if (args[argi] == "-qth") { qth = stoi(args[++argi]); }
 		else { 
@@ -2301,11 +3668,35 @@ int main(int argc, char* argv[]) {
 		}
 		++argi;
 	}
+	assert(not perfCounters or metricsFname.size()); // -pc is reported through -mx
+	assert(not (kmerBinary and writeKmerName));
+	assert(not alnBinary or (aln and countMode != 2)); // -ab only encodes alignments
+	if ((alnBinary or readBinary) and bgzfLevel < 0) { bgzfLevel = 1; }
+	assert(not readBinary or not aln);
+	assert(readBinPrefix.empty() or (fastxFname.empty() and manifestFname.empty() and socketPath.empty() and not extractFastX and not ckptInterval)); // -rb replaces -fa/-fq
+	assert((manifestFname.size() + socketPath.size() > 0) != (fastxFname.size() + readBinPrefix.size() + outPrefix.size() > 0)); // -ms, -sv or -fa/-fq/-rb and -o
+	assert(manifestFname.empty() or socketPath.empty());
+	assert(not (kmerBinary and lociFname.size())); // the rpgg_id of -kb hashes the kmers of all loci
+	assert(lociBedFname.empty() or lociFname.size());
+	assert(not ckptInterval or (not alnBinary and not readBinary and not simmode and not locusQC and not dedup)); // -ab/-eb headers and chunk indexes and the -dd caches are not resumed
+	assert(not dedup or dupCacheSize); // -dd finds duplicates in the -dc caches
+	assert(hugepages.empty() or hugepages == "thp" or hugepages == "hugetlb");
+	if (hugepages == "hugetlb") { execWithHugetlb(argv); }
+	string ckptArgs; // options that must match when resuming from a checkpoint
+	for (uint64_t i = 1; i < argc; ++i) {
+		if (args[i] == "-p" or args[i] == "-ck") { ++i; }
+		else if (args[i] == "-sw") { i += 2; }
+		else { ckptArgs += args[i] + ' '; }
+	}
+
+	string trTab = findKmerTable(trFname), invTab = invkmer ? findKmerTable(trPrefix+".inv.kmers") : ""; // from ktools serialize
 
 	// report parameters
 	cerr << "use baitDB: " << bait << endl
 	     << "extract fastX: " << extractFastX << endl
 	     << "output bubbles: " << outputBubbles << endl
+	     << "duplicate cache size per thread and stage: " << dupCacheSize << endl
+	     << "count duplicates once: " << dedup << endl
 	     << "is Fastq: " << isFastq << endl
 	     << "sim mode: " << simmode << endl
 	     << "trim mode: " << trim << endl
@@ -2323,18 +3714,94 @@ int main(int argc, char* argv[]) {
 	     << "max # of read corrections in threading: " << maxncorrection << endl
 	     << "max # of TR-flank transitions: " << MAX_NT << endl
 	     << "min # of kmer matches for TR spanning read: " << (MAX_NT > 1 ? to_string(NM_TR) : "not allowed") << endl
+	     << "BGZF level for STDOUT (-1=off): " << bgzfLevel << endl
+	     << "adaptive batch size: " << (fixedBatchSize ? "off" : "on") << endl
+	     << "metrics: " << (metricsFname.size() ? metricsFname : "off") << endl
+	     << "hardware counters in metrics: " << perfCounters << endl
+	     << "per-locus cost profile: " << locusCost << endl
+	     << "per-locus QC: " << locusQC << endl
+	     << "memory budget in GB (0=off): " << memBudgetGB << endl
+	     << "huge pages: " << (hugepages.size() ? hugepages : "off") << endl
+	     << "NUMA replicas: " << numa << endl
+	     << "binary .tr.kmers: " << kmerBinary << endl
+	     << "binary alignments: " << alnBinary << endl
+	     << "read bins out/in: " << readBinary << '/' << (readBinPrefix.size() ? readBinPrefix : "off") << endl
+	     << "checkpoint interval in sec (0=off): " << ckptInterval << endl
+	     << "shard: " << shard << '/' << nshard << endl
+	     << "max filter/threading stage threads (0=no cap): " << filterWorkers << '/' << threadWorkers << endl
 	     << "step1 kmer-based filtering: " << (not skip1 ? "on" : "off") << endl
 		 << "step2 threading: " << (threading ? "on" : "off") << endl
 	     << "fastx: " << fastxFname << endl
+	     << "manifest: " << (manifestFname.size() ? manifestFname : "off") << endl
+	     << "job socket: " << (socketPath.size() ? socketPath : "off") << endl
+	     << "locus subset: " << (lociFname.size() ? lociFname : "all") << endl
 	     << "query: " << trPrefix << ".(tr/ntr).kmers" << endl
+	     << "kmer tables: " << (trTab.size() ? trTab : "off") << (invTab.size() ? " " + invTab : "") << endl
 	     << endl
 	     << "total number of loci in " << trFname << ": ";
-	uint64_t nloci = countLoci(trFname);
+	uint64_t nloci = trTab.size() ? kmertab_t(trTab).h.nloci : countLoci(trFname);
 	cerr << nloci << endl;
+	vector<bool> locusSelDB;
+	vector<bool>* locusSel = nullptr;
+	vector<uint64_t> trSkipped, invSkipped; // -lo: # of kmers of each locus not loaded, written as zero counts
+	vector<uint64_t>* trPad = nullptr, *invPad = nullptr;
+	if (lociFname.size() or readBinPrefix.size()) {
+		trSkipped.assign(nloci, 0);
+		invSkipped.assign(nloci, 0);
+		trPad = &trSkipped;
+		invPad = &invSkipped;
+		locusSelDB.assign(nloci, lociFname.empty());
+		if (lociFname.size()) { readLocusSubset(lociFname, lociBedFname, locusSelDB); }
+		if (readBinPrefix.size()) { // step 2 only needs the loci with reads
+			string fn = readBinPrefix + ".reads.bin.idx";
+			chunk_index_t idx;
+			if (not idx.read(fn, READIDX_MAGIC) or idx.nloci() != nloci) {
+				cerr << "ERROR " << fn << " is not a read bin index of this RPGG" << endl;
+				exit(1);
+			}
+			uint64_t nsel = 0;
+			for (uint64_t i = 0; i < nloci; ++i) {
+				locusSelDB[i] = locusSelDB[i] and not idx.empty(i);
+				nsel += locusSelDB[i];
+			}
+			cerr << nsel << " loci with reads in " << readBinPrefix << ".reads.bin" << endl;
+		}
+		locusSel = &locusSelDB;
+	}
+	std::unique_ptr<readbin_reader_t> readBin;
+	if (readBinPrefix.size()) {
+		readBin.reset(new readbin_reader_t(readBinPrefix, lociFname.size() ? locusSel : nullptr));
+		isFastq = readBin->hasQual;
+	}
 
 
+	const uint64_t memBudget = memBudgetGB * (1ULL << 30);
+	bool loadIndex = not skip1, loadGraph = not extractFastX;
+	if (memBudget and not locusSel) {
+		uint64_t need = minLoadBytes(trPrefix, loadIndex, loadGraph);
+		if (need > memBudget) {
+			cerr << "ERROR the index and graphs of " << trPrefix << " need at least " << fmtBytes(need) << ", more than the -mb budget of "
+			     << fmtBytes(memBudget) << endl;
+			exit(1);
+		}
+	}
+
+	vector<vector<int>> numaCpus; // -numa
+	cpu_set_t mainCpus;
+	if (numa) {
+		numaCpus = numaNodeCpus();
+		if (numaCpus.size() < 2) {
+			cerr << "[Warning] " << numaCpus.size() << " NUMA node with cpus found; -numa ignored" << endl;
+			numa = false;
+		}
+		else { // the originals are loaded on node 0
+			sched_getaffinity(0, sizeof(mainCpus), &mainCpus);
+			pinToCpus(numaCpus[0]);
+		}
+	}
+
 	// read input files
-	time_t time1 = time(nullptr);
+	stage_timer_t loadTimer(false);
 	vector<kmer_aCount_umap> trKmerDB(nloci);
 	vector<kmer_aCount_umap> ikmerDB(nloci);
 	vector<GraphType> graphDB(nloci);
@@ -2352,34 +3819,149 @@ int main(int argc, char* argv[]) {
 	err_umap errdb;
 	vector<uint64_t> locusmap;
 
+	{ // the index, graphs, TR kmers, invariant kmers and baits are independent and load concurrently; graphs also per locus
+		vector<std::thread> loaders;
+		if (loadIndex) { loaders.emplace_back([&]() { readBinaryIndex(kmerDBi, kmerDBi_vv, trPrefix, locusSel); }); }
+		if (loadGraph) {
+			loaders.emplace_back([&]() { readBinaryGraph(graphDB, trPrefix, locusSel, nproc); });
+			if (trTab.size()) { loaders.emplace_back([&]() { readKmerTable(trKmerDB, trTab, locusSel, trPad, nproc); }); }
+			else { loaders.emplace_back([&]() { readKmers(trKmerDB, trFname, locusSel, trPad); }); }
+			if (invTab.size()) { loaders.emplace_back([&]() { readKmerTable(ikmerDB, invTab, locusSel, invPad, nproc); }); }
+			else if (invkmer) { loaders.emplace_back([&]() { readiKmers(ikmerDB, trPrefix, locusSel, invPad); }); }
+			//if (bait) { readKmerSet(baitDB, baitFname); }
+			if (bait) { loaders.emplace_back([&]() { readFPSKmersV2(baitDB, baitFname, locusSel); }); }
+		}
+		for (auto& th : loaders) { th.join(); }
+	}
 	if (extractFastX) { // step 1
-		readBinaryIndex(kmerDBi, kmerDBi_vv, trPrefix);
-		cerr << "deserialized index in " << (time(nullptr) - time1) << " sec." << endl;
+		cerr << "deserialized index in " << loadTimer.wallSec() << " sec." << endl;
 		cerr << "# unique kmers in kmerDBi: " << kmerDBi.size() << endl;
-	} else if (skip1) { // step 2, obsolete
-		readBinaryGraph(graphDB, trPrefix);
-		readKmers(trKmerDB, trFname);
-		cerr << "deserialized graph and read tr.kmers in " << (time(nullptr) - time1) << " sec." << endl;
+	} else if (skip1) { // step 2 from -rb read bins
+		cerr << "deserialized graph and read tr.kmers in " << loadTimer.wallSec() << " sec." << endl;
 	} else { // step 1+2
-		readBinaryIndex(kmerDBi, kmerDBi_vv, trPrefix);
-		readBinaryGraph(graphDB, trPrefix);
-		readKmers(trKmerDB, trFname);
-		if (invkmer) { readiKmers(ikmerDB, trPrefix); }
-		//if (bait) { readKmerSet(baitDB, baitFname); }
-		if (bait) { readFPSKmersV2(baitDB, baitFname); }
 		cerr << baitDB.size() << " bait loci in baitDB" << endl;
-		cerr << "deserialized graph/index and read tr.kmers in " << (time(nullptr) - time1) << " sec." << endl;
+		cerr << "deserialized graph/index and read tr.kmers in " << loadTimer.wallSec() << " sec." << endl;
 		cerr << "# unique kmers in kmerDBi: " << kmerDBi.size() << endl;
 	}
 
-	// create data for each process
-	cerr << "creating data for each process..." << endl;
-	time1 = time(nullptr);
-	Threads threaddata(nproc, nloci);
-	uint64_t nReads = 0, nThreadingReads = 0, nFeasibleReads = 0, nAsgnReads = 0, nSubFiltered = 0, nKmerFiltered = 0, nBaitFiltered = 0, nLocusAssignFiltered = 0;
-	for (uint64_t i = 0; i < nproc; ++i) {
-		Counts &counts = threaddata.counts[i];
+	std::deque<rpgg_replica_t> replicas; // -numa: of node 1, 2, ...
+	if (numa) {
+		stage_timer_t t(false);
+		replicas.resize(numaCpus.size() - 1);
+		vector<std::thread> ths;
+		for (uint64_t n = 1; n < numaCpus.size(); ++n) {
+			ths.emplace_back([&, n]() { // pages are placed on the node of the thread that first touches them
+				pinToCpus(numaCpus[n]);
+				rpgg_replica_t& r = replicas[n - 1];
+				r.kmerDBi = kmerDBi;
+				r.kmerDBi_vv = kmerDBi_vv;
+				r.graphDB = graphDB;
+			});
+		}
+		for (auto& th : ths) { th.join(); }
+		sched_setaffinity(0, sizeof(mainCpus), &mainCpus);
+		cerr << "copied the index and graphs to " << replicas.size() << " more NUMA nodes in " << t.wallSec() << " sec" << endl;
+	}
+
+	auto loadReport = [&]() {
+		mem_report_t rep;
+		if (loadIndex) {
+			rep.add("kmerDBi", umapBytes(kmerDBi));
+			rep.add("kmerDBi_vv", vecBytes(kmerDBi_vv));
+		}
+		if (loadGraph) {
+			rep.add("graphDB", umapsBytes(graphDB));
+			rep.add("trKmerDB", umapsBytes(trKmerDB));
+		}
+		if (invkmer) { rep.add("ikmerDB", umapsBytes(ikmerDB)); }
+		if (bait) { rep.add("baitDB", umapsBytes(baitDB)); }
+		if (numa) {
+			uint64_t n = 0;
+			for (auto& r : replicas) { n += umapBytes(r.kmerDBi) + vecBytes(r.kmerDBi_vv) + umapsBytes(r.graphDB); }
+			rep.add("NUMA replicas", n);
+		}
+		rep.print(cerr, "after load", "VmRSS:");
+		return std::max(rep.total(), procStatusBytes("VmRSS:"));
+	};
+	uint64_t loaded = loadReport();
+	uint64_t readMemBudget = 0;
+	if (memBudget) {
+		uint64_t perThread = nproc * 2 * (nloci + 1) * sizeof(uint32_t); // countHit tables
+		uint64_t wanted = 2 * (nproc + 1) * 300000 * readsPerBatchFactor * 1000; // reads in flight at the default batch size
+		if (loaded + perThread + wanted > memBudget) { // denser buckets save ~8 bytes per kmer at the cost of longer chains
+			vector<kmerIndex_uint32_umap*> indexes(1, &kmerDBi);
+			vector<vector<GraphType>*> graphs(1, &graphDB);
+			for (auto& r : replicas) {
+				indexes.push_back(&r.kmerDBi);
+				graphs.push_back(&r.graphDB);
+			}
+			for (auto* m : indexes) {
+				m->max_load_factor(DENSE_LOAD_FACTOR);
+				m->rehash(0);
+			}
+			for (auto* gs : graphs) {
+				for (auto& g : *gs) {
+					g.max_load_factor(DENSE_LOAD_FACTOR);
+					g.rehash(0);
+				}
+			}
+			cerr << "-mb: rehashed kmerDBi and graphDB with max load factor " << DENSE_LOAD_FACTOR << endl;
+			loaded = loadReport();
+		}
+		if (loaded + perThread + MIN_READ_BUDGET > memBudget) {
+			cerr << "ERROR " << fmtBytes(loaded) << " loaded and " << fmtBytes(perThread) << " of per-thread tables leave less than "
+			     << fmtBytes(MIN_READ_BUDGET) << " for reads within the -mb budget of " << fmtBytes(memBudget) << endl;
+			exit(1);
+		}
+		readMemBudget = memBudget - loaded - perThread;
+		cerr << fmtBytes(readMemBudget) << " of the memory budget left for reads" << endl;
+	}
 
+	if (hugepages == "thp") {
+		uint64_t n = adviseHugepages();
+		cerr << "-hp thp: " << fmtBytes(n) << " advised, " << fmtBytes(smapsRollupBytes("AnonHugePages:")) << " in huge pages" << endl;
+	}
+
+	if (metricsFname.size()) {
+		metricsFile.open(metricsFname, std::ios::app);
+		assert(metricsFile);
+	}
+	uint64_t nrun = 0;
+	// returns the # of reads processed and passing threading. A sample that cannot start stops danbing-tk,
+	// except under -sv where err is set and the server moves on to the next job
+	auto runSample = [&](const string& fastxFname, const string& outPrefix, string& err) -> std::pair<uint64_t, uint64_t> {
+		auto fail = [&](const string& msg) {
+			fastxFile.close();
+			if (socketPath.empty()) {
+				cerr << "ERROR " << msg << endl;
+				exit(1);
+			}
+			cerr << "[Warning] job failed: " << msg << endl;
+			err = msg;
+		};
+		if (not fastxFile.is_open() and readBinPrefix.empty()) { // -ms and -sv
+			cerr << "sample " << fastxFname << " -> " << outPrefix << endl;
+			fastxFile.open(fastxFname);
+			if (not fastxFile) {
+				fail("cannot open " + fastxFname);
+				return {0, 0};
+			}
+			isFastq = fastxFile.peek() == '@';
+		}
+		if (nrun++) { // fresh counts; the maps keep their kmers and thus their output order
+			for (auto& db : trKmerDB) { for (auto& p : db) { p.second = 0; } }
+			for (auto& db : ikmerDB) { for (auto& p : db) { p.second = 0; } }
+			for (uint64_t i = 0; i < nloci; ++i) { nmapread[i] = 0; kmc[i] = 0; }
+			bubbleDB.assign(nloci, kmerCount_umap());
+			readDB.clear();
+			fastqDB.clear();
+		}
+
+		// create data for each process
+		cerr << "creating data for each process..." << endl;
+		stage_timer_t queryTimer(false);
+		Counts counts(nloci);
+		uint64_t nReads = 0, nThreadingReads = 0, nFeasibleReads = 0, nAsgnReads = 0, nSubFiltered = 0, nKmerFiltered = 0, nBaitFiltered = 0, nLocusAssignFiltered = 0, nDupLookup = 0, nDupHit = 0;
 		counts.in = &fastxFile;
 		counts.readDB = &readDB;
 		counts.fqDB = &fastqDB;
@@ -2400,9 +3982,12 @@ int main(int argc, char* argv[]) {
 		counts.nKmerFiltered = &nKmerFiltered;
 		counts.nBaitFiltered = &nBaitFiltered;
 		counts.nLocusAssignFiltered = &nLocusAssignFiltered;
+		counts.nDupLookup = &nDupLookup;
+		counts.nDupHit = &nDupHit;
 		counts.msaStats = &msaStats;
 		counts.errdb = &errdb;
 		counts.locusmap = &locusmap;
+		counts.locusSel = locusSel;
 
 		counts.isFastq = isFastq;
 		counts.extractFastX = extractFastX;
@@ -2418,99 +4003,151 @@ int main(int argc, char* argv[]) {
 		counts.skip1 = skip1;
 		counts.countMode = countMode;
 		counts.invkmer = invkmer;
+		counts.dedup = dedup;
+		counts.dupCacheSize = dupCacheSize;
+		counts.bgzfLevel = bgzfLevel;
+		counts.fixedBatchSize = fixedBatchSize;
+		counts.metricsOut = nullptr;
+		counts.metricsInterval = metricsInterval;
+		counts.locusCost = locusCost;
+		counts.locusQC = locusQC;
+		counts.alnBinary = alnBinary;
+		counts.readBinary = readBinary;
+		counts.readBin = readBin.get();
+		counts.ckptInterval = ckptInterval;
+		counts.shard = shard;
+		counts.nshard = nshard;
+		counts.ckptFname = outPrefix + ".ckpt";
+		counts.ckptArgs = ckptArgs;
+		counts.outBytes = 0;
+		counts.readMemBudget = readMemBudget;
+		counts.numaCpus = numa ? &numaCpus : nullptr;
+		counts.replicas = &replicas;
+		counts.perfCounters = perfCounters;
+		if (metricsFname.size()) { counts.metricsOut = &metricsFile; }
+		counts.inSize = 0;
+		struct stat st;
+		if (stat(fastxFname.c_str(), &st) == 0 and S_ISREG(st.st_mode)) { counts.inSize = st.st_size; }
+		if (ckptInterval and not counts.inSize) { // resuming needs a seekable input
+			fail("-ck needs " + fastxFname + " to be a file");
+			return {0, 0};
+		}
+		counts.filterWorkers = filterWorkers;
+		counts.threadWorkers = threadWorkers;
 
 		counts.Cthreshold = Cthreshold;
 		counts.thread_cth = thread_cth;
 		counts.readsPerBatchFactor = readsPerBatchFactor;
-	}
-
-	const int idLen=20;
-	char id[idLen+1];
-	id[idLen] = '\0';
-	srand (time(NULL));
-	rand_str(id, idLen);
-
-	string readerName = string("/semreader_") + string(id);
-	string countName = string("/semcount_") + string(id);
-	string semwriterName = string("/semwriter_") + string(id);
 
-	semreader = sem_open(readerName.c_str(), O_CREAT, 0644, 1);
-	if (semreader == NULL) {
-		cerr << "ERROR opening semaphore. ERRNO " << errno << " " << readerName << endl;
-		exit(1);
-	}
-	semcount = sem_open(countName.c_str(), O_CREAT, 0644, 1);
-	if (semreader == NULL) {
-		cerr << "ERROR opening semaphore. ERRNO " << errno << " " << countName << endl;
-		exit(1);
-	}
-	semwriter = sem_open(semwriterName.c_str(), O_CREAT, 0644, 1);
-	if (semwriter == NULL) {
-		cerr << "ERROR opening semaphore. ERRNO " << errno << " " << semwriterName << endl;
-		exit(1);
-	}
-
-	//ProfilerStart("prefilter.v10.prof");
-	sem_init(semreader, 1, 1);
-	sem_init(semcount, 1, 1);
-	sem_init(semcount, 1, 1);
-
-	pthread_attr_t *threadAttr = new pthread_attr_t[nproc];
-
-	for (uint64_t t = 0; t < nproc; ++t) {
-		pthread_attr_init(&threadAttr[t]);
-	}
-	pthread_t *threads = new pthread_t[nproc];
-
-	// start computing
-	for (uint64_t t = 0; t < nproc; ++t) {
-		pthread_create(&threads[t], &threadAttr[t], (void* (*)(void*))CountWords<uint64_t>, &threaddata.counts[t]);
-	}
-	cerr << "threads created" << endl;
- 
-	for (uint64_t t = 0; t < nproc; ++t) {
-		pthread_join(threads[t], NULL);
-	}
-	//ProfilerFlush();
-	//ProfilerStop();
-
-	cerr << nReads << " reads processed in total.\n"
-	     << nSubFiltered << " reads removed by subsampled kmer-filter.\n"
-	     << nKmerFiltered << " reads removed by kmer-filter.\n"
-	     << nBaitFiltered << " reads removed by bait locus.\n"
-		 << nLocusAssignFiltered << " reads removed during locus assignment.\n"
-	     << nThreadingReads << " reads entered threading step.\n"
-	     << nFeasibleReads << " reads passsed threading.\n"
-	     << nAsgnReads << " reads assigned to TR region.\n"
-	     << "parallel query completed in " << (time(nullptr) - time1) << " sec." << endl;
-	fastxFile.close();
-
-	// write outputs
-	if (not extractFastX) {
-		cerr << "writing kmers..." << endl;
-		if (writeKmerName) {
-			writeKmersWithName(outPrefix+".tr", trKmerDB);
+		//ProfilerStart("prefilter.v10.prof");
+		int outFd = STDOUT_FILENO;
+		if (manifestFname.size() or socketPath.size()) { // what would go to STDOUT goes to a file of the sample
+			string suffix = alnBinary ? ".aln.bin" : readBinary ? ".reads.bin" : aln ? ".aln" : extractFastX ? (isFastq ? ".fq" : ".fa") : countMode == 2 ? ".kam" : "";
+			if (suffix.size()) {
+				if (bgzfLevel >= 0 and not alnBinary) { suffix += ".gz"; }
+				bool resume = ckptInterval and access(counts.ckptFname.c_str(), F_OK) == 0; // keep the output before the checkpoint
+				outFd = open((outPrefix + suffix).c_str(), O_WRONLY | O_CREAT | (resume ? 0 : O_TRUNC), 0644);
+				if (outFd < 0) {
+					fail("cannot write " + outPrefix + suffix);
+					return {0, 0};
+				}
+			}
 		}
-		else {
-			writeKmers(outPrefix+".tr", trKmerDB);
-			if (countMode == 2) {
-				writeTRKmerSummary(outPrefix+".tr.summary.txt", kmc, nmapread);
+		out_writer_t writer(outFd, bgzfLevel >= 0);
+		counts.writer = &writer;
+		AlignPool<uint64_t> alignpool(counts, nproc);
+		if (ckptInterval and alignpool.Resume() and outFd != STDOUT_FILENO) { // drop what the previous run wrote after the checkpoint
+			struct stat ost;
+			if (fstat(outFd, &ost) or (uint64_t)ost.st_size < alignpool.outBytes) {
+				cerr << "ERROR the output of " << outPrefix << " is shorter than its checkpoint. Remove " << counts.ckptFname << " to start over." << endl;
+				exit(1);
 			}
+			int rc = ftruncate(outFd, alignpool.outBytes);
+			assert(rc == 0);
+			lseek(outFd, 0, SEEK_END);
+		}
+		cerr << "threads created" << endl;
+		alignpool.run();
+		writer.close();
+		if (outFd != STDOUT_FILENO) { close(outFd); }
+		if (locusCost) { alignpool.writeLocusCost(outPrefix + ".locus_cost.tsv"); }
+		if (locusQC) { alignpool.writeLocusQC(outPrefix + ".locus_qc"); }
+		{
+			mem_report_t rep;
+			rep.add("loaded", loaded);
+			alignpool.memReport(rep);
+			rep.print(cerr, "at peak", "VmHWM:");
 		}
+		if (alnBinary) { alignpool.writeChunkIndex(outPrefix + ".aln.bin.idx", ALNIDX_MAGIC); }
+		if (readBinary) { alignpool.writeChunkIndex(outPrefix + ".reads.bin.idx", READIDX_MAGIC); }
+		//ProfilerFlush();
+		//ProfilerStop();
+
+		cerr << nReads << " reads processed in total.\n"
+		     << nSubFiltered << " reads removed by subsampled kmer-filter.\n"
+		     << nKmerFiltered << " reads removed by kmer-filter.\n"
+		     << nBaitFiltered << " reads removed by bait locus.\n"
+			 << nLocusAssignFiltered << " reads removed during locus assignment.\n"
+		     << nThreadingReads << " reads entered threading step.\n"
+		     << nFeasibleReads << " reads passsed threading.\n"
+		     << nAsgnReads << " reads assigned to TR region.\n"
+		     << nDupHit << '/' << nDupLookup << " read pairs found in duplicate cache (" << (nDupLookup ? 100.0*nDupHit/nDupLookup : 0) << "%).\n"
+		     << "parallel query completed in " << queryTimer.wallSec() << " sec." << endl;
+		fastxFile.close();
+
+		// write outputs
+		if (not extractFastX) {
+			cerr << "writing kmers..." << endl;
+			if (writeKmerName) {
+				writeKmersWithName(outPrefix+".tr", trKmerDB);
+			}
+			else {
+				if (kmerBinary) { writeKmersBinary(outPrefix+".tr.kmers", trKmerDB, ksize); }
+				else { writeKmers(outPrefix+".tr", trKmerDB, 0, trPad); }
+				if (countMode == 2) {
+					writeTRKmerSummary(outPrefix+".tr.summary.txt", kmc, nmapread);
+				}
+			}
+
+			if (invkmer) {
+				writeKmersWithName(outPrefix+".inv.name", ikmerDB);
+				writeKmers(outPrefix+".inv", ikmerDB, 0, invPad);
+			}
 
-		if (invkmer) {
-			writeKmersWithName(outPrefix+".inv.name", ikmerDB);
-			writeKmers(outPrefix+".inv", ikmerDB);
+			if (outputBubbles) {
+				cerr << "writing bubbles..." << endl;
+				writeBubbles(outPrefix+".bub", bubbleDB);
+			}
 		}
 
-		if (outputBubbles) {
-			cerr << "writing bubbles..." << endl;
-			writeBubbles(outPrefix+".bub", bubbleDB);
+		if (ckptInterval) { remove(counts.ckptFname.c_str()); }
+		return std::make_pair(nReads, nFeasibleReads);
+	};
+
+	if (socketPath.size()) {
+		job_server_t server(socketPath);
+		cerr << "RPGG loaded in " << loadTimer.wallSec() << " sec. Listening on " << socketPath << endl;
+		while (job_t* job = server.next()) {
+			stage_timer_t t(false);
+			string err;
+			auto res = runSample(job->in, job->out, err);
+			server.finish(job, res.first, res.second, t.wallSec(), err.size());
 		}
 	}
+	else {
+		vector<std::pair<string, string>> samples; // input, output prefix
+		if (manifestFname.size()) { readManifest(manifestFname, samples); }
+		else { samples.emplace_back(fastxFname, outPrefix); }
+		string err;
+		for (auto& sample : samples) { runSample(sample.first, sample.second, err); }
+	}
 
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	cerr << "peak RSS: " << ru.ru_maxrss << " KB" << endl;
 	cerr << "all done!" << endl;
 	return 0;
 }
+#endif
 
 
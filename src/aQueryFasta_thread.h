@@ -4,6 +4,8 @@
 #include "cereal/archives/binary.hpp"
 #include "cereal/types/unordered_map.hpp"
 #include "cereal/types/vector.hpp"
+#include "kmerbin.h"
+#include "kmertab.h"
 
 #include "stdlib.h"
 #include <vector>
@@ -23,7 +25,9 @@
 #include <cmath>
 #include <algorithm>
 #include <iomanip>
+#include <tuple>
 #include <atomic>
+#include <thread>
 
 using namespace std;
 
@@ -316,17 +320,26 @@ void read2kmers_qfilter(vector<size_t>& kmers, string& read, size_t k, vector<in
     }
 }
 
-// Applied to a read pair to accumulate counts.
-// Assuming maximal kmer counts from a VNTR read pair does not exceed 32 bits
-void noncaVec2CaUmap(vector<size_t>& kmers, kmerCount_umap& out, size_t ksize) {
+// Applied to a read pair to accumulate counts: appends the canonical kmers of kmers to ckmers, skipping N.
+void noncaVec2CaVec(vector<size_t>& kmers, vector<size_t>& ckmers, size_t ksize) {
     size_t RCkmer;
     for (size_t kmer : kmers) {
 		if (kmer == -1ULL) { continue; }
         RCkmer = getNuRC(kmer, ksize);
-        ++out[(kmer <= RCkmer ? kmer : RCkmer)];
+        ckmers.push_back(kmer <= RCkmer ? kmer : RCkmer);
     }
 }
 
+// ckmers: sorted. Adds the # of occurrences of each distinct kmer to its count in db, if present.
+template <typename T>
+void addSortedKmers(vector<size_t>& ckmers, T& db) {
+	for (size_t i = 0, j; i < ckmers.size(); i = j) {
+		for (j = i + 1; j < ckmers.size() and ckmers[j] == ckmers[i]; ++j) {}
+		auto it = db.find(ckmers[i]);
+		if (it != db.end()) { it->second += j - i; }
+	}
+}
+
 // non-canonical kmer to canonical kmer
 void nonckmer2ckmer(vector<size_t>& kmers, vector<size_t>& ckmers, size_t ksize) {
 	ckmers.resize(kmers.size());
@@ -366,8 +379,9 @@ size_t countBedLoci(string fname) {
 
 }
 
+// sel: loci to load (-lo), nullptr for all; nskip: # of kmers of each locus not loaded
 template <typename T>
-void readiKmers(T& db, string& pref) {
+void readiKmers(T& db, string& pref, const vector<bool>* sel = nullptr, vector<uint64_t>* nskip = nullptr) {
 	ifstream f(pref + ".inv.kmers");
 	assert(f);
 	cerr << "reading invariant kmers from " << pref << ".inv.kmers" << endl;
@@ -375,14 +389,15 @@ void readiKmers(T& db, string& pref) {
 	size_t tri = -1;
 	while (getline(f, line)) {
 		if (line[0] == '>') { ++tri; }
-		else { db[tri][stoul(line)] += 0; }
+		else if (not sel or (*sel)[tri]) { db[tri][stoul(line)] += 0; }
+		else if (nskip) { ++(*nskip)[tri]; }
 	}
 	f.close();
 }
 
 // record kmerDB only
 template <typename T>
-void readKmers(T& kmerDB, string fname) {
+void readKmers(T& kmerDB, string fname, const vector<bool>* sel = nullptr, vector<uint64_t>* nskip = nullptr) {
     ifstream f(fname);
     assert(f);
     cerr << "reading kmers from " << fname << endl;
@@ -390,7 +405,8 @@ void readKmers(T& kmerDB, string fname) {
 	size_t idx = -1;
 	while (getline(f, line)) {
 		if (line[0] == '>') { ++idx; }
-		else { kmerDB[idx][stoul(line)] += 0; }
+		else if (not sel or (*sel)[idx]) { kmerDB[idx][stoul(line)] += 0; }
+		else if (nskip) { ++(*nskip)[idx]; }
 	}
 	f.close();
 }
@@ -436,7 +452,7 @@ void readFPSKmersV1(T& kmerDB, string fname) {
 }
 
 template <typename T>
-void readFPSKmersV2(T& kmerDB, string fname) {
+void readFPSKmersV2(T& kmerDB, string fname, const vector<bool>* sel = nullptr) {
 	size_t tri;
 	string line;
 	ifstream f;
@@ -446,6 +462,7 @@ void readFPSKmersV2(T& kmerDB, string fname) {
 	cerr << "reading kmers from " << fname << endl;
 	while (getline(f, line)) {
 		if (line[0] == '>') { tri = stoul(line.substr(1)); continue; }
+		if (sel and not (*sel)[tri]) { continue; }
 
 		stringstream ss(line);
 		size_t km, mi, ma;
@@ -560,29 +577,181 @@ void mapKmersFile2DB(T& kmerDB, string fname, vector<bool>& omap, bool count=tru
     f.close();
 }
 
-void readBinaryIndex(kmerIndex_uint32_umap& kmerDBi, vector<uint32_t>& kmerDBi_vv, string& pref) {
+// -lo: keeps the kmers of the selected loci, each with all of its loci so that reads of other loci still
+// go elsewhere. The cereal archive stores the map as u64 size then (u64 kmer, u64 index) pairs.
+void readBinaryIndexSubset(kmerIndex_uint32_umap& kmerDBi, vector<uint32_t>& kmerDBi_vv, string& pref, const vector<bool>& sel) {
+	static_assert(sizeof(kmerIndex_uint32_umap::key_type) == 8 and sizeof(kmerIndex_uint32_umap::mapped_type) == 8, "unexpected kmerDBi layout");
+	vector<uint32_t> vv;
 	{
-		cerr << "deserializing kmerDBi.umap" << endl;
-		ifstream fin(pref+".kmerDBi.umap", ios::binary);
+		cerr << "deserializing kmerDBi.vv" << endl;
+		ifstream fin(pref+".kmerDBi.vv", ios::binary);
 		assert(fin);
 		cereal::BinaryInputArchive iarchive(fin);
-		iarchive(kmerDBi);
+		iarchive(vv);
 	}
-	{
-		cerr << "deserializing kmerDBi.vv" << endl;
+	cerr << "filtering kmerDBi.umap" << endl;
+	ifstream fin(pref+".kmerDBi.umap", ios::binary);
+	assert(fin);
+	uint64_t n = 0;
+	fin.read((char*)&n, 8);
+	unordered_map<uint64_t, uint64_t> remap; // offset in vv -> offset in kmerDBi_vv, -1 if no locus is selected
+	kmerDBi_vv.clear();
+	const uint64_t B = 1 << 16;
+	vector<uint64_t> buf(2*B);
+	for (uint64_t beg = 0; beg < n; beg += B) {
+		uint64_t m = std::min(B, n - beg);
+		fin.read((char*)buf.data(), m * 16);
+		assert(fin);
+		for (uint64_t i = 0; i < m; ++i) {
+			uint64_t kmer = buf[2*i], vi = buf[2*i+1];
+			if (vi % 2) {
+				uint64_t j0 = vi >> 1;
+				auto it = remap.find(j0);
+				if (it == remap.end()) {
+					bool keep = false;
+					for (uint64_t j = j0 + 1; j <= j0 + vv[j0]; ++j) { keep |= sel[vv[j]]; }
+					it = remap.emplace(j0, keep ? kmerDBi_vv.size() : -1ULL).first;
+					if (keep) { kmerDBi_vv.insert(kmerDBi_vv.end(), vv.begin() + j0, vv.begin() + j0 + vv[j0] + 1); }
+				}
+				if (it->second == -1ULL) { continue; }
+				vi = (it->second << 1) + 1;
+			}
+			else if (not sel[vi >> 1]) { continue; }
+			kmerDBi[kmer] = vi;
+		}
+	}
+}
+
+void readBinaryIndex(kmerIndex_uint32_umap& kmerDBi, vector<uint32_t>& kmerDBi_vv, string& pref, const vector<bool>* sel = nullptr) {
+	if (sel) {
+		readBinaryIndexSubset(kmerDBi, kmerDBi_vv, pref, *sel);
+		return;
+	}
+	std::thread vvReader([&]() {
+		cerr << "deserializing kmerDBi.vv\n";
 		ifstream fin(pref+".kmerDBi.vv", ios::binary);
 		assert(fin);
 		cereal::BinaryInputArchive iarchive(fin);
 		iarchive(kmerDBi_vv);
+	});
+	// the layout of readBinaryIndexSubset; reserving all buckets up front saves the rehashes of cereal's one-by-one load
+	static_assert(sizeof(kmerIndex_uint32_umap::key_type) == 8 and sizeof(kmerIndex_uint32_umap::mapped_type) == 8, "unexpected kmerDBi layout");
+	cerr << "deserializing kmerDBi.umap\n";
+	ifstream fin(pref+".kmerDBi.umap", ios::binary);
+	assert(fin);
+	uint64_t n = 0;
+	fin.read((char*)&n, 8);
+	kmerDBi.clear();
+	kmerDBi.reserve(n);
+	const uint64_t B = 1 << 16;
+	vector<uint64_t> buf(2*B);
+	for (uint64_t beg = 0; beg < n; beg += B) {
+		uint64_t m = std::min(B, n - beg);
+		fin.read((char*)buf.data(), m * 16);
+		assert(fin);
+		for (uint64_t i = 0; i < m; ++i) { kmerDBi.emplace(buf[2*i], buf[2*i+1]); }
 	}
+	vvReader.join();
 }
 
-void readBinaryGraph(vector<GraphType>& graphDB, string& pref) {
-	cerr << "deserializing graph.umap" << endl;
-	ifstream fin(pref+".graph.umap", ios::binary);
+// the archive is u64 nloci, then per locus u64 size and (u64 kmer, u8 edges) pairs. The loci are located by
+// seeking over the pairs, then handed out to nthreads threads, each filling its own maps.
+// sel: loci to load (-lo), nullptr for all
+void readBinaryGraph(vector<GraphType>& graphDB, string& pref, const vector<bool>* sel = nullptr, uint64_t nthreads = 1) {
+	static_assert(sizeof(GraphType::key_type) == 8 and sizeof(GraphType::mapped_type) == 1, "unexpected graph layout");
+	cerr << "deserializing graph.umap\n";
+	string fn = pref+".graph.umap";
+	ifstream fin(fn, ios::binary);
+	assert(fin);
+	uint64_t n = 0;
+	fin.read((char*)&n, 8);
+	assert(not sel or n == sel->size());
+	graphDB.clear();
+	graphDB.resize(n);
+	vector<uint64_t> offsets(n), sizes(n);
+	uint64_t off = 8;
+	for (uint64_t i = 0; i < n; ++i) {
+		fin.seekg(off);
+		fin.read((char*)&sizes[i], 8);
+		offsets[i] = off + 8;
+		off += 8 + sizes[i] * 9;
+	}
 	assert(fin);
-	cereal::BinaryInputArchive iarchive(fin);
-	iarchive(graphDB);
+	fin.close();
+
+	std::atomic<uint64_t> next(0);
+	auto load = [&]() {
+		ifstream f(fn, ios::binary);
+		assert(f);
+		string buf;
+		for (uint64_t i = next++; i < n; i = next++) {
+			if (sel and not (*sel)[i]) { continue; }
+			uint64_t m = sizes[i];
+			buf.resize(m * 9);
+			f.seekg(offsets[i]);
+			f.read(&buf[0], buf.size());
+			assert(f);
+			GraphType& g = graphDB[i];
+			g.reserve(m);
+			for (uint64_t j = 0; j < m; ++j) {
+				size_t kmer;
+				memcpy(&kmer, &buf[j*9], 8);
+				g.emplace(kmer, buf[j*9 + 8]);
+			}
+		}
+	};
+	vector<std::thread> ths;
+	for (uint64_t t = 1; t < nthreads; ++t) { ths.emplace_back(load); }
+	load();
+	for (auto& th : ths) { th.join(); }
+}
+
+// -lo: 0-based locus ids, one per line, or BED regions, each selecting the loci of locusBed
+// (the VNTR BED the RPGG was built from, one locus per line) it overlaps
+void readLocusSubset(string fname, string locusBed, vector<bool>& sel) {
+	ifstream f(fname);
+	assert(f);
+	vector<std::tuple<string, uint64_t, uint64_t>> regions;
+	string line, chrom;
+	uint64_t nsel = 0;
+	while (getline(f, line)) {
+		if (line.empty() or line[0] == '#') { continue; }
+		stringstream ss(line);
+		uint64_t beg, end;
+		if (ss >> chrom >> beg >> end) { regions.emplace_back(chrom, beg, end); continue; }
+		uint64_t tri = stoul(line);
+		if (tri >= sel.size()) {
+			cerr << "ERROR locus " << tri << " in " << fname << " is out of range; the RPGG has " << sel.size() << " loci" << endl;
+			exit(1);
+		}
+		nsel += not sel[tri];
+		sel[tri] = true;
+	}
+	if (regions.size()) {
+		if (locusBed.empty()) {
+			cerr << "ERROR " << fname << " lists BED regions; -lb is required to map them to loci" << endl;
+			exit(1);
+		}
+		ifstream bed(locusBed);
+		assert(bed);
+		uint64_t tri = 0;
+		while (getline(bed, line)) {
+			stringstream ss(line);
+			uint64_t beg, end;
+			ss >> chrom >> beg >> end;
+			assert(ss and tri < sel.size());
+			for (auto& r : regions) {
+				if (std::get<0>(r) == chrom and std::get<1>(r) < end and beg < std::get<2>(r)) {
+					nsel += not sel[tri];
+					sel[tri] = true;
+					break;
+				}
+			}
+			++tri;
+		}
+		assert(tri == sel.size());
+	}
+	cerr << nsel << " loci selected from " << fname << endl;
 }
 
 
@@ -800,8 +969,9 @@ void writeKmersWithName(string outfpref, T& kmerDB, size_t threshold = 0) {
     fout.close();
 }
 
+// pad: # of zero counts to write for each locus not loaded (-lo)
 template <typename T>
-void writeKmers(string outfpref, T& kmerDB, size_t threshold = 0) {
+void writeKmers(string outfpref, T& kmerDB, size_t threshold = 0, const vector<uint64_t>* pad = nullptr) {
     ofstream fout(outfpref+".kmers");
     assert(fout);
     for (size_t i = 0; i < kmerDB.size(); ++i) {
@@ -809,6 +979,7 @@ void writeKmers(string outfpref, T& kmerDB, size_t threshold = 0) {
             if (p.second < threshold) { continue; }
             fout << (size_t)p.second << '\n';
         }
+        if (pad) { for (uint64_t j = 0; j < (*pad)[i]; ++j) { fout << "0\n"; } }
     }
     fout.close();
 }
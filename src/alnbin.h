@@ -0,0 +1,248 @@
+#ifndef ALNBIN_H_
+#define ALNBIN_H_
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <fstream>
+#include <iostream>
+#include <cassert>
+#include <zlib.h>
+
+/*
+Binary alignment stream (danbing-tk -ab), a BGZF file whose uncompressed content is
+
+  header      magic "DTKALN1\0"
+  records     one per aligned read pair, in the order of the text output of -a/-ae
+
+Each record, with integers as LEB128 varints unless noted:
+
+  size        # of bytes of the rest of the record
+  src+1       0 if the source locus is unknown ('.')
+  dst
+  name        u64 LE, fingerprint of the read name (read names are not stored)
+  read2, read1
+    len, 2-bit packed bases (A=0, C=1, G=2, T=3; 4 per byte, first base in the low bits),
+    number of other characters, then (position delta, char) for each, e.g. N
+  cigar2, annot2, cigar1, annot1
+    number of ops, then one varint per op: low 3 bits are the op code, the rest a run length
+    (ALN_OP_MATCH/NTR/ANY, or ALN_OP_RUN followed by its char), the char (ALN_OP_CHAR) or 0,
+    in which case ALN_OP_X and ALN_OP_D are followed by the graph base
+
+The header and every sub-batch start a new BGZF block, so the stream can be cut at any chunk
+listed in the index. The index (.aln.bin.idx) lists the compressed offset and size of each chunk
+and, for each destination locus, the chunks holding its alignments:
+
+  header      magic "DTKALI1\0", nloci u64, nchunks u64
+  chunks      {offset u64, size u64} x nchunks
+  offsets     u64[nloci+1], index of the first chunk id of each locus
+  chunk ids   u32 x offsets[nloci]
+
+nloci includes a last entry for pairs not aligned to any locus (-a), whose dst is nloci-1.
+
+`ktools view` decodes both back to the text format.
+*/
+
+const char ALNBIN_MAGIC[8] = { 'D', 'T', 'K', 'A', 'L', 'N', '1', '\0' };
+const char ALNIDX_MAGIC[8] = { 'D', 'T', 'K', 'A', 'L', 'I', '1', '\0' };
+
+// run ops are also used for the [=.*] annotation runs
+enum { ALN_OP_MATCH, ALN_OP_NTR, ALN_OP_ANY, ALN_OP_X, ALN_OP_D, ALN_OP_I, ALN_OP_CHAR, ALN_OP_RUN };
+const char alnRunChars[3] = { '=', '.', '*' };
+
+inline void putVarint(std::string& out, uint64_t v) {
+	while (v >= 0x80) { out += (char)(v | 0x80); v >>= 7; }
+	out += (char)v;
+}
+
+inline uint64_t getVarint(const char*& p, const char* end) {
+	uint64_t v = 0;
+	for (int s = 0; p < end; s += 7) {
+		unsigned char c = *p++;
+		v |= (uint64_t)(c & 0x7f) << s;
+		if (c < 0x80) { return v; }
+	}
+	std::cerr << "ERROR truncated .aln.bin record" << std::endl;
+	exit(1);
+}
+
+inline void putU64(std::string& out, uint64_t v) {
+	for (int i = 0; i < 8; ++i) { out += (char)(v >> (8*i)); }
+}
+
+inline uint64_t getU64(const char*& p) {
+	uint64_t v = 0;
+	for (int i = 0; i < 8; ++i) { v |= (uint64_t)(unsigned char)p[i] << (8*i); }
+	p += 8;
+	return v;
+}
+
+// op code of a run char, or -1
+inline int alnRunOp(char c) {
+	return c == '=' ? ALN_OP_MATCH : c == '.' ? ALN_OP_NTR : c == '*' ? ALN_OP_ANY : -1;
+}
+
+// run of ct chars c, printed as <ct><c>
+inline void putRun(std::string& ops, uint64_t ct, char c) {
+	int op = alnRunOp(c);
+	if (op >= 0) { putVarint(ops, (ct << 3) | op); }
+	else { putVarint(ops, (ct << 3) | ALN_OP_RUN); ops += c; }
+}
+
+inline void encodeSeq(std::string& out, const std::string& seq) {
+	static const unsigned char nt2code[4] = { 'A', 'C', 'G', 'T' };
+	putVarint(out, seq.size());
+	std::vector<std::pair<uint64_t, char>> exc;
+	size_t beg = out.size();
+	out.append((seq.size() + 3) / 4, '\0');
+	for (size_t i = 0; i < seq.size(); ++i) {
+		unsigned char c = seq[i], code = 0;
+		while (code < 4 and nt2code[code] != c) { ++code; }
+		if (code == 4) { exc.emplace_back(i, c); code = 0; }
+		out[beg + i/4] |= code << (2*(i%4));
+	}
+	putVarint(out, exc.size());
+	uint64_t last = 0;
+	for (auto& e : exc) {
+		putVarint(out, e.first - last);
+		out += e.second;
+		last = e.first;
+	}
+}
+
+inline void decodeSeq(const char*& p, const char* end, std::string& seq) {
+	static const char code2nt[4] = { 'A', 'C', 'G', 'T' };
+	uint64_t len = getVarint(p, end);
+	assert(p + (len + 3) / 4 <= end);
+	seq.resize(len);
+	for (uint64_t i = 0; i < len; ++i) { seq[i] = code2nt[((unsigned char)p[i/4] >> (2*(i%4))) & 3]; }
+	p += (len + 3) / 4;
+	uint64_t nexc = getVarint(p, end), pos = 0;
+	for (uint64_t i = 0; i < nexc; ++i) {
+		pos += getVarint(p, end);
+		assert(p < end and pos < len);
+		seq[pos] = *p++;
+	}
+}
+
+// prints the ops of a cigar or annotation in the text format of writeCigar/writeAnnot
+inline void decodeOps(const char*& p, const char* end, std::ostream& out) {
+	uint64_t nops = getVarint(p, end);
+	if (not nops) { out << '*'; return; }
+	for (uint64_t i = 0; i < nops; ++i) {
+		uint64_t v = getVarint(p, end);
+		int op = v & 7;
+		if (op <= ALN_OP_ANY) { out << (v >> 3) << alnRunChars[op]; }
+		else if (op == ALN_OP_X or op == ALN_OP_D) {
+			assert(p < end);
+			out << (op == ALN_OP_X ? 'X' : 'D') << *p++;
+		}
+		else if (op == ALN_OP_I) { out << 'I'; }
+		else if (op == ALN_OP_CHAR) { out << (char)(v >> 3); }
+		else {
+			assert(p < end);
+			out << (v >> 3) << *p++;
+		}
+	}
+}
+
+// destination locus of the record at p, which starts after the record size
+inline uint64_t alnRecordDst(const char* p, const char* end) {
+	getVarint(p, end);
+	return getVarint(p, end);
+}
+
+// decodes one record, starting after the record size, and prints it as a line of the -a/-ae
+// text output with the name fingerprint as title
+inline void decodeAlnRecord(const char*& p, const char* end, std::ostream& out, std::string& buf) {
+	uint64_t src = getVarint(p, end);
+	uint64_t dst = getVarint(p, end);
+	assert(p + 8 <= end);
+	uint64_t fp = getU64(p);
+	char title[20];
+	snprintf(title, sizeof(title), ">%016llx", (unsigned long long)fp);
+	if (src) { out << src - 1 << '\t'; }
+	else { out << '.' << '\t'; }
+	out << dst << '\t' << title << '\t';
+	decodeSeq(p, end, buf);
+	out << buf << '\t';
+	decodeSeq(p, end, buf);
+	out << buf;
+	for (int i = 0; i < 4; ++i) {
+		out << '\t';
+		decodeOps(p, end, out);
+	}
+	out << '\n';
+}
+
+// chunk index shared by .aln.bin.idx and .reads.bin.idx
+struct chunk_index_t {
+	std::vector<std::pair<uint64_t, uint64_t>> chunks; // compressed offset and size
+	std::vector<uint64_t> offsets; // nloci+1
+	std::vector<uint32_t> ids;
+
+	bool read(const std::string& fn, const char* magic) {
+		std::ifstream fin(fn, std::ios::binary);
+		char m[8] = {};
+		uint64_t nloci = 0, nchunks = 0;
+		fin.read(m, 8);
+		fin.read((char*)&nloci, 8);
+		fin.read((char*)&nchunks, 8);
+		if (not fin or memcmp(m, magic, 8)) { return false; }
+		chunks.resize(nchunks);
+		offsets.resize(nloci + 1);
+		for (auto& c : chunks) {
+			fin.read((char*)&c.first, 8);
+			fin.read((char*)&c.second, 8);
+		}
+		fin.read((char*)offsets.data(), offsets.size() * 8);
+		ids.resize(offsets[nloci]);
+		fin.read((char*)ids.data(), ids.size() * sizeof(uint32_t));
+		return (bool)fin;
+	}
+
+	uint64_t nloci() const { return offsets.size() - 1; }
+	bool empty(uint64_t locus) const { return offsets[locus] == offsets[locus+1]; }
+};
+
+// reads and inflates the next BGZF block of fp into out; returns its compressed size, 0 at EOF
+inline size_t bgzf_read_block(FILE* fp, std::string& out) {
+	const size_t BGZF_HEADER = 18, BGZF_FOOTER = 8;
+	unsigned char header[BGZF_HEADER];
+	size_t n = fread(header, 1, BGZF_HEADER, fp);
+	if (n == 0) { return 0; }
+	if (n != BGZF_HEADER or header[0] != 31 or header[1] != 139 or header[12] != 'B' or header[13] != 'C') {
+		std::cerr << "ERROR not a BGZF block" << std::endl;
+		exit(1);
+	}
+	size_t bsize = (header[16] | (header[17] << 8)) + 1;
+	std::string block(bsize - BGZF_HEADER, '\0');
+	if (fread(&block[0], 1, block.size(), fp) != block.size()) {
+		std::cerr << "ERROR truncated BGZF block" << std::endl;
+		exit(1);
+	}
+	const unsigned char* f = (const unsigned char*)block.data() + block.size() - BGZF_FOOTER;
+	uint32_t len = f[4] | (f[5] << 8) | (f[6] << 16) | ((uint32_t)f[7] << 24);
+	size_t beg = out.size();
+	out.resize(beg + len);
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	int ret = inflateInit2(&zs, -15); // raw deflate
+	assert(ret == Z_OK);
+	zs.next_in = (Bytef*)block.data();
+	zs.avail_in = block.size() - BGZF_FOOTER;
+	zs.next_out = (Bytef*)(&out[0] + beg);
+	zs.avail_out = len;
+	ret = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	if ((ret != Z_STREAM_END and len) or zs.total_out != len) {
+		std::cerr << "ERROR corrupted BGZF block" << std::endl;
+		exit(1);
+	}
+	return bsize;
+}
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <cassert>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+Align checkpoint (danbing-tk -ck), little endian:
+
+  header      magic "DTKCKP1\0", then the fields of checkpoint_t in declaration order.
+              Strings and vectors are prefixed by their length as u64.
+
+Only nonzero kmer counts are stored, so a checkpoint is small early in a run and at most
+16 bytes per kmer. It is written to a temporary file, synced and renamed, so a crash while
+writing leaves the previous checkpoint intact.
+*/
+
+const char CKPT_MAGIC[8] = { 'D', 'T', 'K', 'C', 'K', 'P', '1', '\0' };
+
+enum { CKPT_READS, CKPT_THREADING, CKPT_FEASIBLE, CKPT_ASGN, CKPT_SUB_FILTERED, CKPT_KMER_FILTERED,
+       CKPT_BAIT_FILTERED, CKPT_LOCUS_FILTERED, CKPT_DUP_LOOKUP, CKPT_DUP_HIT, N_CKPT_STAT };
+
+typedef std::vector<std::vector<std::pair<uint64_t, uint64_t>>> kmer_counts_t; // per locus, nonzero (kmer, count)
+
+// db: vector of kmer -> count maps, e.g. vector<kmer_aCount_umap>
+template <typename T>
+void copyNonzeroCounts(kmer_counts_t& dst, const T& db) {
+	dst.assign(db.size(), std::vector<std::pair<uint64_t, uint64_t>>());
+	for (size_t i = 0; i < db.size(); ++i) {
+		for (auto& p : db[i]) {
+			if (p.second) { dst[i].emplace_back(p.first, (uint64_t)p.second); }
+		}
+	}
+}
+
+template <typename T>
+void restoreCounts(const kmer_counts_t& src, T& db) {
+	assert(src.size() == db.size());
+	for (size_t i = 0; i < src.size(); ++i) {
+		for (auto& p : src[i]) { db[i][p.first] = p.second; }
+	}
+}
+
+struct checkpoint_t {
+	std::string args;     // options that must match on resume
+	uint64_t inOffset;    // input byte offset of the next read
+	uint64_t outBytes;    // bytes written to STDOUT before inOffset
+	uint64_t stats[N_CKPT_STAT];
+	std::vector<std::string> mates; // reads waiting for their mate: title, seq[, qual] each
+	std::vector<uint32_t> nmapread;
+	std::vector<uint64_t> kmc;
+	kmer_counts_t tr, inv, bubbles;
+
+	void write(const std::string& fn) const {
+		std::string tmp = fn + ".tmp";
+		std::ofstream fout(tmp, std::ios::binary);
+		assert(fout);
+		fout.write(CKPT_MAGIC, 8);
+		putString(fout, args);
+		putU64(fout, inOffset);
+		putU64(fout, outBytes);
+		fout.write((char*)stats, sizeof(stats));
+		putU64(fout, mates.size());
+		for (auto& s : mates) { putString(fout, s); }
+		putVector(fout, nmapread);
+		putVector(fout, kmc);
+		putCounts(fout, tr);
+		putCounts(fout, inv);
+		putCounts(fout, bubbles);
+		fout.close();
+		int fd = open(tmp.c_str(), O_RDONLY);
+		if (not fout or fd < 0 or fsync(fd)) {
+			std::cerr << "ERROR writing checkpoint " << tmp << std::endl;
+			exit(1);
+		}
+		close(fd);
+		if (rename(tmp.c_str(), fn.c_str())) {
+			std::cerr << "ERROR renaming " << tmp << " to " << fn << std::endl;
+			exit(1);
+		}
+	}
+
+	// false if fn does not exist
+	bool read(const std::string& fn) {
+		std::ifstream fin(fn, std::ios::binary);
+		if (not fin) { return false; }
+		char magic[8] = {};
+		fin.read(magic, 8);
+		if (memcmp(magic, CKPT_MAGIC, 8)) {
+			std::cerr << fn << " is not a danbing-tk checkpoint" << std::endl;
+			exit(1);
+		}
+		getString(fin, args);
+		inOffset = getU64(fin);
+		outBytes = getU64(fin);
+		fin.read((char*)stats, sizeof(stats));
+		mates.resize(getU64(fin));
+		for (auto& s : mates) { getString(fin, s); }
+		getVector(fin, nmapread);
+		getVector(fin, kmc);
+		getCounts(fin, tr);
+		getCounts(fin, inv);
+		getCounts(fin, bubbles);
+		if (not fin) {
+			std::cerr << "ERROR truncated checkpoint " << fn << std::endl;
+			exit(1);
+		}
+		return true;
+	}
+
+private:
+	static void putU64(std::ostream& out, uint64_t v) { out.write((char*)&v, 8); }
+	static uint64_t getU64(std::istream& in) { uint64_t v = 0; in.read((char*)&v, 8); return v; }
+
+	static void putString(std::ostream& out, const std::string& s) {
+		putU64(out, s.size());
+		out.write(s.data(), s.size());
+	}
+	static void getString(std::istream& in, std::string& s) {
+		s.resize(getU64(in));
+		in.read(&s[0], s.size());
+	}
+
+	template <typename T>
+	static void putVector(std::ostream& out, const std::vector<T>& v) {
+		putU64(out, v.size());
+		out.write((char*)v.data(), v.size() * sizeof(T));
+	}
+	template <typename T>
+	static void getVector(std::istream& in, std::vector<T>& v) {
+		v.resize(getU64(in));
+		in.read((char*)v.data(), v.size() * sizeof(T));
+	}
+
+	static void putCounts(std::ostream& out, const kmer_counts_t& c) {
+		putU64(out, c.size());
+		for (auto& v : c) { putVector(out, v); }
+	}
+	static void getCounts(std::istream& in, kmer_counts_t& c) {
+		c.resize(getU64(in));
+		for (auto& v : c) { getVector(in, v); }
+	}
+};
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef JOBSERVER_H_
+#define JOBSERVER_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <deque>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cerrno>
+#include <cassert>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+Job queue of danbing-tk -sv, fed over a Unix domain socket.
+
+Each connection sends one request line and gets the reply before the server closes it:
+
+  submit INPUT OUT_PREFIX   ->  "ok JOB_ID" or "error MESSAGE"
+  status [JOB_ID]           ->  one line per job: JOB_ID STATE INPUT OUT_PREFIX READS FEASIBLE_READS SEC
+  metrics                   ->  "uptime_sec N jobs_done N jobs_failed N jobs_queued N reads N busy_sec N"
+  shutdown                  ->  "ok"; queued jobs still run, new ones are refused
+
+e.g. echo "submit reads.fa out/s1" | nc -U danbing.sock
+Jobs run one at a time on all worker threads, in submission order. A job whose input or output
+cannot be opened when it starts is marked failed and the server goes on with the next one.
+*/
+
+struct job_t {
+	uint64_t id;
+	std::string in, out;
+	std::string state = "queued"; // queued, running, done, failed
+	uint64_t nReads = 0, nFeasibleReads = 0;
+	double sec = 0;
+};
+
+class job_server_t {
+public:
+	job_server_t(const std::string& path_) : path(path_), tStart(std::chrono::steady_clock::now()) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		assert(fd >= 0);
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		assert(path.size() < sizeof(addr.sun_path));
+		strcpy(addr.sun_path, path.c_str());
+		unlink(path.c_str()); // a stale socket of a previous server
+		if (bind(fd, (sockaddr*)&addr, sizeof(addr)) or listen(fd, 16)) {
+			std::cerr << "ERROR cannot listen on " << path << ". ERRNO " << errno << std::endl;
+			exit(1);
+		}
+		th = std::thread(&job_server_t::serve, this);
+	}
+
+	~job_server_t() {
+		shutdown(fd, SHUT_RDWR); // wakes up accept()
+		close(fd);
+		if (th.joinable()) { th.join(); }
+		unlink(path.c_str());
+	}
+
+	// blocks until a job is queued; nullptr once shut down and drained
+	job_t* next() {
+		std::unique_lock<std::mutex> lk(m);
+		cv.wait(lk, [&]{ return stopped or nextJob < jobs.size(); });
+		if (nextJob == jobs.size()) { return nullptr; }
+		jobs[nextJob].state = "running";
+		return &jobs[nextJob++];
+	}
+
+	void finish(job_t* job, uint64_t nReads, uint64_t nFeasibleReads, double sec, bool failed) {
+		std::lock_guard<std::mutex> lk(m);
+		job->state = failed ? "failed" : "done";
+		job->nReads = nReads;
+		job->nFeasibleReads = nFeasibleReads;
+		job->sec = sec;
+		totalReads += nReads;
+		busySec += sec;
+	}
+
+private:
+	std::string path;
+	int fd;
+	std::thread th;
+	std::mutex m;
+	std::condition_variable cv;
+	std::deque<job_t> jobs; // guarded by m; deque keeps job pointers valid
+	size_t nextJob = 0;
+	bool stopped = false;
+	uint64_t totalReads = 0;
+	double busySec = 0;
+	std::chrono::steady_clock::time_point tStart;
+
+	void serve() {
+		while (true) {
+			int cfd = accept(fd, nullptr, nullptr);
+			if (cfd < 0) {
+				if (errno == EINTR) { continue; }
+				break; // socket closed
+			}
+			std::string req, reply;
+			char c;
+			while (read(cfd, &c, 1) == 1 and c != '\n') { req += c; }
+			reply = handle(req);
+			size_t off = 0;
+			while (off < reply.size()) {
+				ssize_t n = send(cfd, reply.data() + off, reply.size() - off, MSG_NOSIGNAL); // the client may be gone
+				if (n <= 0) { break; }
+				off += n;
+			}
+			close(cfd);
+		}
+	}
+
+	std::string handle(const std::string& req) {
+		std::istringstream iss(req);
+		std::ostringstream out;
+		std::string cmd;
+		iss >> cmd;
+		std::lock_guard<std::mutex> lk(m);
+		if (cmd == "submit") {
+			job_t job;
+			if (not (iss >> job.in >> job.out)) { return "error usage: submit INPUT OUT_PREFIX\n"; }
+			if (stopped) { return "error shutting down\n"; }
+			if (not std::ifstream(job.in)) { return "error cannot open " + job.in + "\n"; }
+			std::string kmers = job.out + ".tr.kmers", dir = job.out.substr(0, job.out.rfind('/') + 1); // checked without creating or truncating anything
+			if (access(kmers.c_str(), F_OK) == 0 ? access(kmers.c_str(), W_OK) : access(dir.empty() ? "." : dir.c_str(), W_OK)) {
+				return "error cannot write " + kmers + "\n";
+			}
+			job.id = jobs.size();
+			jobs.push_back(job);
+			cv.notify_all();
+			out << "ok " << job.id << '\n';
+		}
+		else if (cmd == "status") {
+			uint64_t id;
+			bool one = (bool)(iss >> id);
+			if (one and id >= jobs.size()) { return "error no such job\n"; }
+			for (uint64_t i = one ? id : 0; i < (one ? id + 1 : jobs.size()); ++i) {
+				job_t& j = jobs[i];
+				out << j.id << ' ' << j.state << ' ' << j.in << ' ' << j.out << ' ' << j.nReads << ' ' << j.nFeasibleReads << ' ' << j.sec << '\n';
+			}
+		}
+		else if (cmd == "metrics") {
+			uint64_t ndone = 0, nfailed = 0;
+			for (auto& j : jobs) {
+				ndone += j.state == "done";
+				nfailed += j.state == "failed";
+			}
+			out << "uptime_sec " << std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count()
+			    << " jobs_done " << ndone << " jobs_failed " << nfailed << " jobs_queued " << jobs.size() - nextJob
+			    << " reads " << totalReads << " busy_sec " << busySec << '\n';
+		}
+		else if (cmd == "shutdown") {
+			stopped = true;
+			cv.notify_all();
+			out << "ok\n";
+		}
+		else { out << "error unknown command: " << cmd << '\n'; }
+		return out.str();
+	}
+};
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef KMERBIN_H_
+#define KMERBIN_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <cassert>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+Binary .tr.kmers (danbing-tk -kb), little endian:
+
+  header      magic "DTKKMB1\0", rpgg_id u64, k u32, width u32, nloci u64, nkmers u64
+  offsets     u64[nloci+1], index of the first kmer of each locus; offsets[nloci] == nkmers
+  counts      nkmers unsigned ints of `width` bytes (1, 2, 4 or 8)
+
+Counts are in the order of the rows of text .tr.kmers, so a binary and a text output of the same
+RPGG line up column by column, e.g. with the invariant kmer indices of danbing-tk-pred. That order
+depends on how the kmers were loaded, so rpgg_id is a hash of the kmers of all loci in the order of
+the counts; files with the same rpgg_id can be combined column by column. The offset table replaces
+the .ksi of `ktools sum`.
+*/
+
+const char KMERBIN_MAGIC[8] = { 'D', 'T', 'K', 'K', 'M', 'B', '1', '\0' };
+
+struct kmerbin_header_t {
+	char magic[8];
+	uint64_t rpggId;
+	uint32_t k, width;
+	uint64_t nloci, nkmers;
+};
+static_assert(sizeof(kmerbin_header_t) == 40, "kmerbin_header_t must not be padded");
+
+inline bool isLittleEndian() {
+	uint32_t x = 1;
+	return *(char*)&x == 1;
+}
+
+inline uint64_t kmerbin_mix(uint64_t h, uint64_t x) {
+	h ^= x + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// true if fn starts with the binary .tr.kmers magic
+inline bool isKmerBinary(const std::string& fn) {
+	std::ifstream fin(fn, std::ios::binary);
+	char magic[8] = {};
+	fin.read(magic, 8);
+	return fin and memcmp(magic, KMERBIN_MAGIC, 8) == 0;
+}
+
+// offsets and counts as in the file; the width is chosen from the largest count
+inline void writeKmerCountsBinary(std::string fn, uint64_t rpggId, uint32_t k, const std::vector<uint64_t>& offsets, const std::vector<uint64_t>& counts) {
+	assert(isLittleEndian());
+	assert(offsets.size() and offsets.back() == counts.size());
+	kmerbin_header_t h;
+	memcpy(h.magic, KMERBIN_MAGIC, 8);
+	h.rpggId = rpggId;
+	h.k = k;
+	h.nloci = offsets.size() - 1;
+	h.nkmers = counts.size();
+	uint64_t maxc = 0;
+	for (uint64_t c : counts) { maxc = std::max(maxc, c); }
+	h.width = maxc < (1ULL << 8) ? 1 : maxc < (1ULL << 16) ? 2 : maxc < (1ULL << 32) ? 4 : 8;
+
+	std::ofstream fout(fn, std::ios::binary);
+	assert(fout);
+	fout.write((char*)&h, sizeof(h));
+	fout.write((char*)offsets.data(), offsets.size() * sizeof(uint64_t));
+	std::vector<char> buf(h.width * std::min<uint64_t>(counts.size(), 1 << 20));
+	for (uint64_t beg = 0; beg < counts.size(); beg += buf.size() / h.width) {
+		uint64_t n = std::min<uint64_t>(counts.size() - beg, buf.size() / h.width);
+		for (uint64_t i = 0; i < n; ++i) { memcpy(&buf[i * h.width], &counts[beg + i], h.width); } // little endian: low bytes first
+		fout.write(buf.data(), n * h.width);
+	}
+	fout.close();
+}
+
+// kmerDB: vector of kmer -> count maps, e.g. vector<kmer_aCount_umap>; counts in the iteration order of writeKmers
+template <typename T>
+void writeKmersBinary(std::string fn, T& kmerDB, uint32_t k) {
+	uint64_t rpggId = 0;
+	std::vector<uint64_t> offsets(1, 0), counts;
+	for (size_t i = 0; i < kmerDB.size(); ++i) {
+		rpggId = kmerbin_mix(rpggId, kmerDB[i].size());
+		for (auto& p : kmerDB[i]) {
+			rpggId = kmerbin_mix(rpggId, p.first);
+			counts.push_back(p.second);
+		}
+		offsets.push_back(counts.size());
+	}
+	writeKmerCountsBinary(fn, rpggId, k, offsets, counts);
+}
+
+// read-only mmap of a binary .tr.kmers
+struct kmerbin_t {
+	kmerbin_header_t h;
+	const uint64_t* offsets = nullptr;
+	const unsigned char* counts = nullptr;
+	void* map = MAP_FAILED;
+	size_t mapSize = 0;
+
+	kmerbin_t(const std::string& fn) {
+		assert(isLittleEndian());
+		int fd = open(fn.c_str(), O_RDONLY);
+		assert(fd >= 0);
+		struct stat st;
+		fstat(fd, &st);
+		mapSize = st.st_size;
+		assert(mapSize >= sizeof(h));
+		map = mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		assert(map != MAP_FAILED);
+		memcpy(&h, map, sizeof(h));
+		if (memcmp(h.magic, KMERBIN_MAGIC, 8)) {
+			std::cerr << fn << " is not a binary .tr.kmers file" << std::endl;
+			exit(1);
+		}
+		offsets = (const uint64_t*)((const char*)map + sizeof(h));
+		counts = (const unsigned char*)(offsets + h.nloci + 1);
+		assert(sizeof(h) + (h.nloci + 1) * sizeof(uint64_t) + h.nkmers * h.width == mapSize);
+		madvise(map, mapSize, MADV_SEQUENTIAL);
+	}
+
+	~kmerbin_t() { if (map != MAP_FAILED) { munmap(map, mapSize); } }
+
+	kmerbin_t(const kmerbin_t&) = delete;
+	kmerbin_t& operator=(const kmerbin_t&) = delete;
+
+	uint64_t count(uint64_t i) const {
+		switch (h.width) {
+			case 1: return counts[i];
+			case 2: { uint16_t v; memcpy(&v, counts + 2*i, 2); return v; }
+			case 4: { uint32_t v; memcpy(&v, counts + 4*i, 4); return v; }
+			default: { uint64_t v; memcpy(&v, counts + 8*i, 8); return v; }
+		}
+	}
+
+	// sum of kmer counts of each locus
+	void locusSums(std::vector<uint64_t>& sums) const {
+		sums.assign(h.nloci, 0);
+		for (uint64_t i = 0; i < h.nloci; ++i) {
+			for (uint64_t j = offsets[i]; j < offsets[i+1]; ++j) { sums[i] += count(j); }
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,187 @@
+#ifndef KMERTAB_H_
+#define KMERTAB_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <cassert>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kmerbin.h"
+
+/*
+Kmer tables (`ktools serialize` writes pan.tr.ktab, and pan.inv.ktab if pan.inv.kmers exists), little endian:
+
+  header      magic "DTKKTB2\0", rpgg_id u64, text_bytes u64, text_mtime u64, text_hash u64, nloci u64, nkmers u64
+  offsets     u64[nloci+1], index of the first kmer of each locus; offsets[nloci] == nkmers
+  kmers       u64[nkmers]
+
+Kmers are in the order of the text file. danbing-tk inserts them into its count tables in that order,
+which sets the row order of the text .tr.kmers it writes, so outputs do not depend on which of the two
+was loaded. rpgg_id is a hash of the kmers in file order. text_bytes, text_mtime (ns) and text_hash
+describe the text file the table was made from. A table is ignored if the size differs, or if the
+mtime differs and so does the hash of the content; copies that keep the content still use the table.
+*/
+
+const char KMERTAB_MAGIC[8] = { 'D', 'T', 'K', 'K', 'T', 'B', '2', '\0' };
+
+struct kmertab_header_t {
+	char magic[8];
+	uint64_t rpggId, textBytes, textMtime, textHash, nloci, nkmers;
+};
+static_assert(sizeof(kmertab_header_t) == 56, "kmertab_header_t must not be padded");
+
+inline uint64_t mtimeNs(const struct stat& st) { return st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec; }
+
+// hash of the content of a file, 0 if it cannot be read
+inline uint64_t fileHash(const std::string& fn) {
+	int fd = open(fn.c_str(), O_RDONLY);
+	if (fd < 0) { return 0; }
+	struct stat st;
+	fstat(fd, &st);
+	uint64_t n = st.st_size, h = kmerbin_mix(0, n), x;
+	void* map = n ? mmap(nullptr, n, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (map == MAP_FAILED) { return n ? 0 : h; }
+	madvise(map, n, MADV_SEQUENTIAL);
+	const char* p = (const char*)map;
+	for (uint64_t i = 0; i + 8 <= n; i += 8) {
+		memcpy(&x, p + i, 8);
+		h = kmerbin_mix(h, x);
+	}
+	x = 0;
+	memcpy(&x, p + n / 8 * 8, n % 8);
+	h = kmerbin_mix(h, x);
+	munmap(map, n);
+	return h;
+}
+
+// pref.tr.kmers -> pref.tr.ktab
+inline std::string kmerTableName(const std::string& textFn) {
+	std::string s = ".kmers";
+	if (textFn.size() >= s.size() and textFn.compare(textFn.size() - s.size(), s.size(), s) == 0) {
+		return textFn.substr(0, textFn.size() - s.size()) + ".ktab";
+	}
+	return textFn + ".ktab";
+}
+
+// reads a text kmer file ('>' lines start a locus, each other line starts with a kmer) into a table
+inline void writeKmerTable(const std::string& textFn, const std::string& fn) {
+	assert(isLittleEndian());
+	std::ifstream fin(textFn);
+	assert(fin);
+	std::vector<uint64_t> offsets, kmers;
+	std::string line;
+	while (getline(fin, line)) {
+		if (line[0] == '>') { offsets.push_back(kmers.size()); }
+		else { kmers.push_back(stoul(line)); }
+	}
+	offsets.push_back(kmers.size());
+
+	kmertab_header_t h;
+	memcpy(h.magic, KMERTAB_MAGIC, 8);
+	h.rpggId = 0;
+	h.nloci = offsets.size() - 1;
+	h.nkmers = kmers.size();
+	struct stat st;
+	int rc = stat(textFn.c_str(), &st);
+	assert(rc == 0);
+	h.textBytes = st.st_size;
+	h.textMtime = mtimeNs(st);
+	h.textHash = fileHash(textFn);
+	for (uint64_t i = 0; i < h.nloci; ++i) {
+		h.rpggId = kmerbin_mix(h.rpggId, offsets[i+1] - offsets[i]);
+		for (uint64_t j = offsets[i]; j < offsets[i+1]; ++j) { h.rpggId = kmerbin_mix(h.rpggId, kmers[j]); }
+	}
+
+	std::ofstream fout(fn, std::ios::binary);
+	assert(fout);
+	fout.write((char*)&h, sizeof(h));
+	fout.write((char*)offsets.data(), offsets.size() * sizeof(uint64_t));
+	fout.write((char*)kmers.data(), kmers.size() * sizeof(uint64_t));
+	assert(fout);
+	fout.close();
+}
+
+// read-only mmap of a kmer table
+struct kmertab_t {
+	kmertab_header_t h;
+	const uint64_t* offsets = nullptr;
+	const uint64_t* kmers = nullptr;
+	void* map = MAP_FAILED;
+	size_t mapSize = 0;
+
+	kmertab_t(const std::string& fn) {
+		assert(isLittleEndian());
+		int fd = open(fn.c_str(), O_RDONLY);
+		assert(fd >= 0);
+		struct stat st;
+		fstat(fd, &st);
+		mapSize = st.st_size;
+		assert(mapSize >= sizeof(h));
+		map = mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		assert(map != MAP_FAILED);
+		memcpy(&h, map, sizeof(h));
+		if (memcmp(h.magic, KMERTAB_MAGIC, 8)) {
+			std::cerr << fn << " is not a danbing-tk kmer table" << std::endl;
+			exit(1);
+		}
+		offsets = (const uint64_t*)((const char*)map + sizeof(h));
+		kmers = offsets + h.nloci + 1;
+		assert(sizeof(h) + (h.nloci + 1 + h.nkmers) * sizeof(uint64_t) == mapSize);
+		madvise(map, mapSize, MADV_WILLNEED);
+	}
+
+	~kmertab_t() { if (map != MAP_FAILED) { munmap(map, mapSize); } }
+
+	kmertab_t(const kmertab_t&) = delete;
+	kmertab_t& operator=(const kmertab_t&) = delete;
+};
+
+// the table of textFn if it exists and was made from the current textFn, otherwise ""
+inline std::string findKmerTable(const std::string& textFn) {
+	std::string fn = kmerTableName(textFn);
+	std::ifstream fin(fn, std::ios::binary);
+	kmertab_header_t h;
+	if (not fin.read((char*)&h, sizeof(h)) or memcmp(h.magic, KMERTAB_MAGIC, 8)) { return ""; }
+	struct stat st;
+	if (stat(textFn.c_str(), &st) or (uint64_t)st.st_size != h.textBytes or (mtimeNs(st) != h.textMtime and fileHash(textFn) != h.textHash)) {
+		std::cerr << "[Warning] " << fn << " does not match " << textFn << "; rerun ktools serialize. Reading the text file instead" << std::endl;
+		return "";
+	}
+	return fn;
+}
+
+// the counterpart of readKmers/readiKmers: zero counts for the kmers of each locus, loci split across nthreads threads.
+// sel: loci to load (-lo), nullptr for all; nskip: # of kmers of each locus not loaded
+template <typename T>
+void readKmerTable(T& db, const std::string& fn, const std::vector<bool>* sel = nullptr, std::vector<uint64_t>* nskip = nullptr, uint64_t nthreads = 1) {
+	std::cerr << "reading kmers from " + fn + "\n";
+	kmertab_t tab(fn);
+	assert(tab.h.nloci == db.size());
+	std::atomic<uint64_t> next(0);
+	auto load = [&]() {
+		for (uint64_t i = next++; i < tab.h.nloci; i = next++) {
+			if (sel and not (*sel)[i]) {
+				if (nskip) { (*nskip)[i] += tab.offsets[i+1] - tab.offsets[i]; }
+				continue;
+			}
+			for (uint64_t j = tab.offsets[i]; j < tab.offsets[i+1]; ++j) { db[i][tab.kmers[j]] += 0; }
+		}
+	};
+	std::vector<std::thread> ths;
+	for (uint64_t t = 1; t < nthreads; ++t) { ths.emplace_back(load); }
+	load();
+	for (auto& th : ths) { th.join(); }
+}
+
+#endif
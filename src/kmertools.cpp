@@ -1,4 +1,5 @@
 #include "aQueryFasta_thread.h"
+#include "alnbin.h"
 #include "cereal/archives/binary.hpp"
 #include "cereal/types/unordered_map.hpp"
 #include "cereal/types/vector.hpp"
@@ -19,6 +20,92 @@ using std::ofstream;
 using std::string;
 using std::vector;
 
+// line by line sum of text outputs of -sh shards. keyed: all but the last tab-separated field
+// must agree and the last is summed, otherwise all fields are summed; '>' lines must agree
+void mergeTextCounts(const vector<string>& fns, const string& outfn, bool keyed) {
+	vector<ifstream> fins;
+	for (auto& fn : fns) {
+		fins.emplace_back(fn);
+		assert(fins.back());
+	}
+	ofstream fout(outfn);
+	assert(fout);
+	string line, line0;
+	uint64_t nline = 0;
+	while (getline(fins[0], line0)) {
+		++nline;
+		vector<uint64_t> sums;
+		size_t keyEnd = keyed ? line0.rfind('\t') + 1 : 0; // 0 if there is no tab
+		for (size_t f = 0; f < fins.size(); ++f) {
+			if (f and not getline(fins[f], line)) {
+				cerr << "ERROR " << fns[f] << " has fewer lines than " << fns[0] << endl;
+				exit(1);
+			}
+			const string& l = f ? line : line0;
+			if (line0[0] == '>' or line0.compare(0, keyEnd, l, 0, keyEnd)) {
+				if (l == line0) { continue; }
+				cerr << "ERROR line " << nline << " of " << fns[f] << " does not match " << fns[0] << endl;
+				exit(1);
+			}
+			std::istringstream iss(l.substr(keyEnd));
+			uint64_t v;
+			for (size_t i = 0; iss >> v; ++i) {
+				if (i == sums.size()) { sums.push_back(0); }
+				sums[i] += v;
+			}
+		}
+		if (line0[0] == '>') { fout << line0 << '\n'; continue; }
+		fout << line0.substr(0, keyEnd);
+		for (size_t i = 0; i < sums.size(); ++i) { fout << (i ? "\t" : "") << sums[i]; }
+		fout << '\n';
+	}
+	for (size_t f = 1; f < fins.size(); ++f) {
+		if (getline(fins[f], line)) {
+			cerr << "ERROR " << fns[f] << " has more lines than " << fns[0] << endl;
+			exit(1);
+		}
+	}
+	fout.close();
+}
+
+void mergeBinaryCounts(const vector<string>& fns, const string& outfn) {
+	vector<uint64_t> sums;
+	kmerbin_t kb0(fns[0]);
+	sums.assign(kb0.h.nkmers, 0);
+	for (auto& fn : fns) {
+		kmerbin_t kb(fn);
+		if (kb.h.rpggId != kb0.h.rpggId or kb.h.k != kb0.h.k or kb.h.nkmers != kb0.h.nkmers) {
+			cerr << "ERROR " << fn << " was generated with a different RPGG than " << fns[0] << endl;
+			exit(1);
+		}
+		for (uint64_t i = 0; i < kb.h.nkmers; ++i) { sums[i] += kb.count(i); }
+	}
+	vector<uint64_t> offsets(kb0.offsets, kb0.offsets + kb0.h.nloci + 1);
+	writeKmerCountsBinary(outfn, kb0.h.rpggId, kb0.h.k, offsets, sums);
+}
+
+void mergeBubbles(const vector<string>& fns, const string& outfn) {
+	bubble_db_t bubbleDB;
+	for (auto& fn : fns) {
+		ifstream fin(fn);
+		assert(fin);
+		string line;
+		size_t locus = 0;
+		while (getline(fin, line)) {
+			if (line[0] == '>') {
+				locus = stoul(line.substr(1));
+				if (locus >= bubbleDB.size()) { bubbleDB.resize(locus + 1); }
+				continue;
+			}
+			size_t tab = line.find('\t');
+			bubbleDB[locus][stoul(line.substr(0, tab))] += stoul(line.substr(tab + 1));
+		}
+	}
+	writeBubbles(outfn, bubbleDB);
+}
+
+inline bool fileExists(const string& fn) { return ifstream(fn).good(); }
+
 int main (int argc, const char * argv[]) {
 	
 	if (argc == 1) {
@@ -28,7 +115,9 @@ int main (int argc, const char * argv[]) {
 			 << "  ksi         generate ksi index for ktools sum" << endl
 		     << "  sum         acculumate kmer counts for each locus" << endl
 		     << "  extract     extract locus-RPGG from RPGG" << endl
-		     << "  serialize   generate kmer index using pan.(graph|ntr|tr).kmers" << endl << endl;
+		     << "  serialize   generate kmer index and tables using pan.(graph|ntr|tr|inv).kmers" << endl
+		     << "  view        convert binary alignments (.aln.bin) to text" << endl
+		     << "  merge-partials   sum the outputs of danbing-tk -sh shards" << endl << endl;
 		return 0;
 	}
 
@@ -60,25 +149,28 @@ int main (int argc, const char * argv[]) {
 			cerr << "Usage 1: ktools sum <.ksi> <.kmers> <out.kms>\n" <<
 			        "  Read a single .kmers file and write a single column output.\n" <<
 			        "Usage 2: ktools sum -f <.ksi> <.txt> <out.kms>\n" << 
-			        "  Read all kmer files specified in .txt and output a kms table (row=sample, col=locus)." << endl;
+			        "  Read all kmer files specified in .txt and output a kms table (row=sample, col=locus).\n" <<
+			        "Binary .kmers files (danbing-tk -kb) carry their own locus offsets; <.ksi> can be - if all inputs are binary." << endl;
 			return 0;
 		}
 
 		if (args[2] == "-f") {
-			ifstream ksif(args[3]);
             ifstream fofn(args[4]);
             ofstream fout(args[5]);
-            assert(ksif);
             assert(fofn);
             assert(fout);
 
             vector<size_t> ksi;
             string line;
-            while (getline(ksif, line)) {
-                ksi.push_back(stoul(line));
-            }
-			ksif.close();
-            cerr << ksi.size() << " loci in " << args[3] << endl;
+			if (args[3] != "-") {
+				ifstream ksif(args[3]);
+				assert(ksif);
+				while (getline(ksif, line)) {
+					ksi.push_back(stoul(line));
+				}
+				ksif.close();
+				cerr << ksi.size() << " loci in " << args[3] << endl;
+			}
 
 			vector<string> kmerfs;
 			while (getline(fofn, line)) {
@@ -88,7 +180,22 @@ int main (int argc, const char * argv[]) {
 			cerr << kmerfs.size() << " samples in " << args[4] << endl;
 
 			size_t ki;
+			uint64_t rpggId = 0;
+			bool hasBinary = false;
+			vector<uint64_t> sums;
 			for (size_t fi = 0; fi < kmerfs.size(); ++fi) {
+				if (isKmerBinary(kmerfs[fi])) {
+					kmerbin_t kb(kmerfs[fi]);
+					if (hasBinary) { assert(kb.h.rpggId == rpggId); } // all samples genotyped with the same RPGG
+					hasBinary = true;
+					rpggId = kb.h.rpggId;
+					assert(ksi.empty() or ksi.size() == kb.h.nloci);
+					kb.locusSums(sums);
+					for (uint64_t i = 0; i < sums.size(); ++i) { fout << sums[i] << (i + 1 == sums.size() ? '\n' : '\t'); }
+					ki = kb.h.nkmers;
+					continue;
+				}
+				assert(ksi.size()); // text .kmers files need the .ksi
 	            ifstream kmerf(kmerfs[fi]);
 				assert(kmerf);
 				size_t idx = 0, kms = 0;
@@ -107,6 +214,16 @@ int main (int argc, const char * argv[]) {
 			fout.close();
             cerr << ki << " kmers processed in each file" << endl;
 		} 
+		else if (isKmerBinary(args[3])) { // locus offsets are embedded, <.ksi> is not read
+			kmerbin_t kb(args[3]);
+			ofstream fout(args[4]);
+			assert(fout);
+			vector<uint64_t> sums;
+			kb.locusSums(sums);
+			for (uint64_t s : sums) { fout << s << '\n'; }
+			fout.close();
+			cerr << kb.h.nloci << " loci and " << kb.h.nkmers << " kmers processed in " << args[3] << endl;
+		}
 		else {
 			ifstream ksif(args[2]);
 			ifstream kmerf(args[3]);
@@ -174,7 +291,7 @@ int main (int argc, const char * argv[]) {
 		if (argc == 2) {
 			cerr << "Usage: ktools serialize <pref>" << endl << endl
 
-			     << "  PREF     prefix of *.(graph|ntr|tr).kmers" << endl;
+			     << "  PREF     prefix of *.(graph|ntr|tr).kmers and the optional *.inv.kmers" << endl;
 			return 0;
 		}
 
@@ -313,6 +430,22 @@ int main (int argc, const char * argv[]) {
 			cerr << "validating kmerDBi.vv" << endl;
 			for (size_t i = 0; i < vv.size(); ++i) { assert(vv[i] == vv_copy[i]); }
 		}
+
+		for (string x : { ".tr", ".inv" }) {
+			string fn = args[2] + x + ".kmers";
+			if (not fileExists(fn)) { continue; }
+			cerr << "serializing " << x.substr(1) << ".ktab" << endl;
+			writeKmerTable(fn, kmerTableName(fn));
+			cerr << "validating " << x.substr(1) << ".ktab" << endl;
+			vector<kmer_aCount_umap> textDB(nloci), tabDB(nloci);
+			readKmers(textDB, fn);
+			readKmerTable(tabDB, kmerTableName(fn));
+			for (size_t i = 0; i < nloci; ++i) { // same insertion order, so the same iteration order
+				assert(textDB[i].size() == tabDB[i].size());
+				auto it = tabDB[i].begin();
+				for (auto& p : textDB[i]) { assert(p.first == (it++)->first); }
+			}
+		}
 		cerr << "Done!" << endl;
 
 		// 1-step method
@@ -333,6 +466,131 @@ int main (int argc, const char * argv[]) {
 		//cerr << "# unique kmers in kmerDBi: " << kmerDBi.size() << '\n';
 		//cerr << "read *.kmers file in " << (time(nullptr) - time1) << " sec." << endl;
 	}
+	else if (args[1] == "view") {
+		if (argc == 2) {
+			cerr << "Usage: ktools view <in.aln.bin> [<in.aln.bin.idx> <LOCUS> ...] >$OUT.aln" << endl
+			     << "  Write alignments from danbing-tk -ab in the text format of -a/-ae." << endl
+			     << "  Read names are replaced by their fingerprints." << endl
+			     << "  If loci are given, only alignments to these loci are read, using the index." << endl << endl;
+			return 0;
+		}
+
+		FILE* fp = fopen(args[2].c_str(), "rb");
+		assert(fp);
+		string buf, seq;
+		bgzf_read_block(fp, buf);
+		if (buf.size() < 8 or memcmp(buf.data(), ALNBIN_MAGIC, 8)) {
+			cerr << args[2] << " is not a binary alignment file" << endl;
+			return 1;
+		}
+		uint64_t nrec = 0;
+		std::ostringstream out;
+		// decodes complete records in buf[pos:], keeps loci[dst] ones if loci is not empty
+		auto decode = [&](size_t& pos, const vector<bool>& loci) {
+			while (pos < buf.size()) {
+				const char* p = buf.data() + pos;
+				const char* end = buf.data() + buf.size();
+				uint64_t n = 0;
+				int s = 0;
+				for (; p < end; s += 7) { // record size, possibly split across blocks
+					n |= (uint64_t)(*p & 0x7f) << s;
+					if (not (*p++ & 0x80)) { break; }
+				}
+				if (p == end or end - p < (ptrdiff_t)n) { return; }
+				const char* recEnd = p + n;
+				if (loci.empty() or (alnRecordDst(p, recEnd) < loci.size() and loci[alnRecordDst(p, recEnd)])) {
+					decodeAlnRecord(p, recEnd, out, seq);
+					assert(p == recEnd);
+					++nrec;
+				}
+				pos = recEnd - buf.data();
+			}
+		};
+		auto flush = [&](size_t& pos) {
+			cout << out.str();
+			out.str("");
+			buf.erase(0, pos);
+			pos = 0;
+		};
+
+		size_t pos = 0;
+		if (argc == 3) {
+			buf.clear();
+			while (bgzf_read_block(fp, buf)) {
+				decode(pos, vector<bool>());
+				flush(pos);
+			}
+		}
+		else {
+			chunk_index_t idx;
+			if (not idx.read(args[3], ALNIDX_MAGIC)) {
+				cerr << args[3] << " is not a binary alignment index" << endl;
+				return 1;
+			}
+			uint64_t nloci = idx.nloci(), nchunks = idx.chunks.size();
+			vector<bool> loci(nloci, false);
+			vector<uint32_t> ids;
+			for (int i = 4; i < argc; ++i) {
+				uint64_t l = stoul(args[i]);
+				assert(l < nloci);
+				loci[l] = true;
+				ids.insert(ids.end(), idx.ids.begin() + idx.offsets[l], idx.ids.begin() + idx.offsets[l+1]);
+			}
+			std::sort(ids.begin(), ids.end());
+			ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+			for (uint32_t id : ids) {
+				buf.clear();
+				fseek(fp, idx.chunks[id].first, SEEK_SET);
+				for (uint64_t nread = 0; nread < idx.chunks[id].second; ) {
+					size_t n = bgzf_read_block(fp, buf);
+					assert(n);
+					nread += n;
+				}
+				decode(pos, loci);
+				assert(pos == buf.size());
+				flush(pos);
+			}
+			cerr << ids.size() << " of " << nchunks << " chunks read" << endl;
+		}
+		assert(buf.empty());
+		fclose(fp);
+		cerr << nrec << " alignments written" << endl;
+	}
+	else if (args[1] == "merge-partials") {
+		if (argc < 5) {
+			cerr << "Usage: ktools merge-partials <out.pref> <in.pref> <in.pref> ..." << endl
+			     << "  Sum the .tr.kmers, .tr.summary.txt, .inv.kmers and .bub of danbing-tk -sh shards, i.e. runs" << endl
+			     << "  of the same RPGG and options with -sh 0/N ... -sh N-1/N, into out.pref.*" << endl
+			     << "  Text .(tr|inv).kmers are summed line by line and must come from the same danbing-tk binary;" << endl
+			     << "  binary .tr.kmers (-kb) are checked for a matching RPGG." << endl << endl;
+			return 0;
+		}
+
+		string opref = args[2];
+		vector<string> ipref(args.begin() + 3, args.end());
+		for (string suffix : { ".tr.kmers", ".tr.summary.txt", ".inv.kmers", ".bub" }) {
+			vector<string> fns;
+			for (auto& p : ipref) {
+				if (fileExists(p + suffix)) { fns.push_back(p + suffix); }
+			}
+			if (fns.empty()) { continue; }
+			if (fns.size() != ipref.size()) {
+				cerr << "ERROR " << suffix << " is missing for some of the shards" << endl;
+				return 1;
+			}
+			bool binary = isKmerBinary(fns[0]);
+			for (auto& fn : fns) {
+				if (isKmerBinary(fn) != binary) {
+					cerr << "ERROR " << fn << " and " << fns[0] << " are in different formats" << endl;
+					return 1;
+				}
+			}
+			if (binary) { mergeBinaryCounts(fns, opref + suffix); }
+			else if (suffix == string(".bub")) { mergeBubbles(fns, opref + suffix); }
+			else { mergeTextCounts(fns, opref + suffix, suffix != string(".tr.summary.txt")); }
+			cerr << fns.size() << " shards merged into " << opref + suffix << endl;
+		}
+	}
 	else {
 		cerr << "Unrecognized command " << args[1] << endl;
 		return 0;
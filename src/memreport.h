@@ -0,0 +1,83 @@
+#ifndef MEMREPORT_H_
+#define MEMREPORT_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <sys/stat.h>
+
+/*
+Memory accounting of danbing-tk align (printed after loading the RPGG and after each sample).
+
+Hash map sizes are estimated from the libstdc++ layout: one heap node per element, holding the
+element and a next pointer and rounded up to the glibc malloc chunk size, plus one pointer per
+bucket. Strings count their heap buffer only when it is not the inline one.
+*/
+
+inline uint64_t mallocChunk(uint64_t n) { return std::max<uint64_t>(32, (n + 8 + 15) / 16 * 16); }
+
+template <typename M>
+uint64_t umapBytes(const M& m) {
+	return m.size() * mallocChunk(sizeof(typename M::value_type) + sizeof(void*)) + m.bucket_count() * sizeof(void*);
+}
+
+template <typename T>
+uint64_t vecBytes(const std::vector<T>& v) { return v.capacity() * sizeof(T); }
+
+// vector of hash maps, e.g. vector<GraphType>
+template <typename M>
+uint64_t umapsBytes(const std::vector<M>& v) {
+	uint64_t n = vecBytes(v);
+	for (auto& m : v) { n += umapBytes(m); }
+	return n;
+}
+
+inline uint64_t strBytes(const std::string& s) { return s.capacity() > 15 ? mallocChunk(s.capacity() + 1) : 0; }
+
+inline uint64_t fileBytes(const std::string& fn) {
+	struct stat st;
+	return stat(fn.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+// a field of /proc/self/status such as "VmRSS:" or "VmHWM:" in bytes, 0 if unknown
+inline uint64_t procStatusBytes(const std::string& field) {
+	std::ifstream fin("/proc/self/status");
+	std::string key, unit;
+	uint64_t kb;
+	while (fin >> key) {
+		if (key == field and fin >> kb >> unit) { return kb * 1024; }
+		fin.ignore(1 << 16, '\n');
+	}
+	return 0;
+}
+
+inline std::string fmtBytes(uint64_t b) {
+	char s[32];
+	snprintf(s, sizeof(s), "%.1f MB", b / 1048576.0);
+	return s;
+}
+
+struct mem_report_t {
+	std::vector<std::pair<std::string, uint64_t>> items;
+
+	void add(const std::string& name, uint64_t bytes) { items.emplace_back(name, bytes); }
+
+	uint64_t total() const {
+		uint64_t n = 0;
+		for (auto& p : items) { n += p.second; }
+		return n;
+	}
+
+	// rssField: "VmRSS:" for the current RSS, "VmHWM:" for the peak
+	void print(std::ostream& out, const std::string& when, const std::string& rssField) const {
+		out << "memory " << when << ':';
+		for (auto& p : items) { out << ' ' << p.first << ' ' << fmtBytes(p.second) << ','; }
+		out << " total " << fmtBytes(total()) << ", " << (rssField == "VmHWM:" ? "peak RSS " : "RSS ") << fmtBytes(procStatusBytes(rssField)) << std::endl;
+	}
+};
+
+#endif
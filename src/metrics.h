@@ -0,0 +1,157 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <cstdint>
+#include <ostream>
+#include <ctime>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/*
+Helpers for the align metrics report (-mx), written as JSON lines.
+*/
+
+// log2-bucketed histogram: b[0] counts 0, b[i] counts values in [2^(i-1), 2^i)
+struct hist_t {
+	static const int NB = 33;
+	uint64_t b[NB] = {};
+
+	void add(uint64_t v) {
+		int i = v ? 64 - __builtin_clzll(v) : 0;
+		++b[i < NB ? i : NB-1];
+	}
+
+	void merge(const hist_t& h) {
+		for (int i = 0; i < NB; ++i) { b[i] += h.b[i]; }
+	}
+
+	// JSON array with trailing empty buckets removed
+	void write(std::ostream& out) const {
+		int n = NB;
+		while (n > 1 and b[n-1] == 0) { --n; }
+		out << '[';
+		for (int i = 0; i < n; ++i) { out << (i ? "," : "") << b[i]; }
+		out << ']';
+	}
+};
+
+// hardware counters, in the order they are opened by perf_group_t
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_LLC_MISSES, PERF_BRANCH_MISSES, N_PERF };
+const char* perfNames[N_PERF] = { "cycles", "instructions", "llc_misses", "branch_misses" };
+
+struct perf_counts_t {
+	uint64_t v[N_PERF] = {};
+
+	void add(const perf_counts_t& beg, const perf_counts_t& end) {
+		for (int i = 0; i < N_PERF; ++i) { v[i] += end.v[i] - beg.v[i]; }
+	}
+
+	void merge(const perf_counts_t& c) {
+		for (int i = 0; i < N_PERF; ++i) { v[i] += c.v[i]; }
+	}
+
+	// JSON object with raw counts, IPC and misses per 1000 instructions
+	void write(std::ostream& out) const {
+		out << '{';
+		for (int i = 0; i < N_PERF; ++i) { out << (i ? "," : "") << '"' << perfNames[i] << "\":" << v[i]; }
+		double ins = v[PERF_INSTRUCTIONS];
+		out << ",\"ipc\":" << (v[PERF_CYCLES] ? ins / v[PERF_CYCLES] : 0)
+		    << ",\"llc_mpki\":" << (ins ? v[PERF_LLC_MISSES] * 1000 / ins : 0)
+		    << ",\"branch_mpki\":" << (ins ? v[PERF_BRANCH_MISSES] * 1000 / ins : 0) << '}';
+	}
+};
+
+/*
+User-space hardware counters of the calling thread, read as one perf_event_open group.
+open() must be called from the thread to be measured. It fails e.g. when
+kernel.perf_event_paranoid forbids it or in VMs without a virtual PMU.
+*/
+struct perf_group_t {
+	int fds[N_PERF] = { -1, -1, -1, -1 };
+	int err = 0; // errno of a failed open()
+
+	~perf_group_t() { close(); }
+
+	bool opened() const { return fds[0] >= 0; }
+
+	bool open() {
+		static const uint64_t configs[N_PERF] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+		for (int i = 0; i < N_PERF; ++i) {
+			perf_event_attr a;
+			memset(&a, 0, sizeof(a));
+			a.size = sizeof(a);
+			a.type = PERF_TYPE_HARDWARE;
+			a.config = configs[i];
+			a.disabled = (i == 0); // the leader starts the whole group
+			a.exclude_kernel = 1;
+			a.exclude_hv = 1;
+			a.read_format = PERF_FORMAT_GROUP;
+			fds[i] = syscall(SYS_perf_event_open, &a, 0, -1, i ? fds[0] : -1, 0);
+			if (fds[i] < 0) {
+				err = errno;
+				close();
+				return false;
+			}
+		}
+		ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		return true;
+	}
+
+	void read(perf_counts_t& c) {
+		uint64_t buf[1 + N_PERF];
+		if (::read(fds[0], buf, sizeof(buf)) != (ssize_t)sizeof(buf)) { return; }
+		memcpy(c.v, buf + 1, sizeof(c.v));
+	}
+
+	void close() {
+		for (int i = N_PERF-1; i >= 0; --i) {
+			if (fds[i] >= 0) { ::close(fds[i]); }
+			fds[i] = -1;
+		}
+	}
+};
+
+// align phases measured with hardware counters (-pc)
+enum { PHASE_KFILTER, PHASE_COUNTHIT, PHASE_THREAD, PHASE_OUTPUT, N_PHASE };
+const char* phaseNames[N_PHASE] = { "kfilter", "countHit", "thread", "output" };
+
+// per-batch distributions
+struct batch_metrics_t {
+	hist_t kmersPerRead;  // canonical kmers per read
+	hist_t lociPerPair;   // candidate loci touched by countHit before early stopping
+	hist_t corrPerRead;   // error correction attempts per threaded read
+	perf_counts_t perf[N_PHASE]; // -pc only
+
+	void merge(const batch_metrics_t& m) {
+		kmersPerRead.merge(m.kmersPerRead);
+		lociPerPair.merge(m.lociPerPair);
+		corrPerRead.merge(m.corrPerRead);
+		for (int i = 0; i < N_PHASE; ++i) { perf[i].merge(m.perf[i]); }
+	}
+};
+
+// CPU time of the calling thread in sec
+inline double threadCpuSec() {
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// wall time and, if requested, thread CPU time since construction
+struct stage_timer_t {
+	std::chrono::steady_clock::time_point t0;
+	double cpu0;
+	bool cpu;
+
+	stage_timer_t(bool cpu_) : t0(std::chrono::steady_clock::now()), cpu0(cpu_ ? threadCpuSec() : 0), cpu(cpu_) {}
+
+	double wallSec() const { return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count(); }
+	double cpuSec() const { return cpu ? threadCpuSec() - cpu0 : 0; }
+};
+
+#endif
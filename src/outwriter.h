@@ -0,0 +1,157 @@
+#ifndef OUTWRITER_H_
+#define OUTWRITER_H_
+
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cassert>
+#include <iostream>
+#include <unistd.h>
+#include <errno.h>
+#include <zlib.h>
+
+/*
+Asynchronous output writer.
+
+Producers format their output into private buffers and hand them over in the order they
+should appear. A dedicated thread issues large write(2) calls, so producers only wait when
+`maxbuf` buffers are already pending (double buffering by default).
+
+BGZF compression is done by the producers with `bgzf_compress` before handing a buffer over,
+so compression runs on all worker threads; the writer thread only appends the BGZF EOF marker.
+*/
+
+// compress `in` into consecutive BGZF blocks appended to `out`
+inline void bgzf_compress(const std::string& in, std::string& out, int level) {
+	const size_t BGZF_MAX_INPUT = 0xff00; // leaves room for incompressible data in a 64 KB block
+	const size_t BGZF_MAX_BLOCK = 0x10000;
+	const size_t BGZF_HEADER = 18, BGZF_FOOTER = 8;
+	char block[BGZF_MAX_BLOCK];
+	for (size_t beg = 0; beg < in.size(); beg += BGZF_MAX_INPUT) {
+		size_t len = std::min(BGZF_MAX_INPUT, in.size() - beg);
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		int ret = deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY); // raw deflate
+		assert(ret == Z_OK);
+		zs.next_in = (Bytef*)(in.data() + beg);
+		zs.avail_in = len;
+		zs.next_out = (Bytef*)(block + BGZF_HEADER);
+		zs.avail_out = BGZF_MAX_BLOCK - BGZF_HEADER - BGZF_FOOTER;
+		ret = deflate(&zs, Z_FINISH);
+		assert(ret == Z_STREAM_END);
+		size_t bsize = BGZF_HEADER + zs.total_out + BGZF_FOOTER;
+		deflateEnd(&zs);
+
+		const unsigned char header[BGZF_HEADER] = { 31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0,
+		                                       (unsigned char)((bsize-1) & 0xff), (unsigned char)((bsize-1) >> 8) };
+		memcpy(block, header, BGZF_HEADER);
+		uint32_t crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef*)(in.data() + beg), len);
+		char* f = block + bsize - BGZF_FOOTER;
+		for (int i = 0; i < 4; ++i) { f[i] = (crc >> (8*i)) & 0xff; }
+		for (int i = 0; i < 4; ++i) { f[4+i] = (len >> (8*i)) & 0xff; }
+		out.append(block, bsize);
+	}
+}
+
+class out_writer_t {
+public:
+	out_writer_t(int fd_, bool bgzf_, size_t maxbuf_ = 2) : fd(fd_), bgzf(bgzf_), maxbuf(maxbuf_) {
+		th = std::thread(&out_writer_t::work, this);
+	}
+
+	~out_writer_t() { close(); }
+
+	// takes ownership of the content of buf
+	void push(std::string& buf) {
+		if (buf.empty()) { return; }
+		std::unique_lock<std::mutex> lk(m);
+		cv.wait(lk, [&]{ return q.size() < maxbuf; });
+		q.emplace_back();
+		q.back().swap(buf);
+		cv.notify_all();
+	}
+
+	// flush pending buffers and stop the writer thread
+	void close() {
+		if (not th.joinable()) { return; }
+		{
+			std::lock_guard<std::mutex> lk(m);
+			closed = true;
+		}
+		cv.notify_all();
+		th.join();
+	}
+
+	uint64_t nBytes() {
+		std::lock_guard<std::mutex> lk(m);
+		return nbytes;
+	}
+
+	// wait until at least n bytes have been written, then fsync (a no-op for pipes)
+	void sync(uint64_t n) {
+		{
+			std::unique_lock<std::mutex> lk(m);
+			cv.wait(lk, [&]{ return nbytes >= n or finished; });
+		}
+		fsync(fd);
+	}
+
+private:
+	int fd;
+	bool bgzf;
+	size_t maxbuf;
+	std::thread th;
+	std::mutex m;
+	std::condition_variable cv;
+	std::deque<std::string> q;
+	bool closed = false, finished = false;
+	uint64_t nbytes = 0; // guarded by m
+
+	void writeAll(const std::string& buf) {
+		size_t off = 0;
+		while (off < buf.size()) {
+			ssize_t n = ::write(fd, buf.data() + off, buf.size() - off);
+			if (n < 0) {
+				if (errno == EINTR) { continue; }
+				std::cerr << "ERROR writing output. ERRNO " << errno << std::endl;
+				exit(1);
+			}
+			off += n;
+		}
+		{
+			std::lock_guard<std::mutex> lk(m);
+			nbytes += buf.size();
+		}
+		cv.notify_all();
+	}
+
+	void work() {
+		std::string buf;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lk(m);
+				cv.wait(lk, [&]{ return closed or q.size(); });
+				if (q.empty()) { break; }
+				buf.swap(q.front());
+				q.pop_front();
+			}
+			cv.notify_all();
+			writeAll(buf);
+			buf.clear();
+		}
+		if (bgzf and nBytes()) { // empty block marking the end of a BGZF file
+			static const char eofBlock[28] = { 31, (char)139, 8, 4, 0, 0, 0, 0, 0, (char)255, 6, 0, 'B', 'C', 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+			writeAll(std::string(eofBlock, 28));
+		}
+		{
+			std::lock_guard<std::mutex> lk(m);
+			finished = true;
+		}
+		cv.notify_all();
+	}
+};
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef PLACEMENT_H_
+#define PLACEMENT_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cerrno>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+Placement of the read-only RPGG (danbing-tk -hp, -numa).
+
+-hp thp      after loading, the anonymous mappings holding the RPGG are marked MADV_HUGEPAGE and
+             collapsed into 2 MB pages right away with MADV_COLLAPSE (Linux 6.1+; older kernels
+             leave the collapse to khugepaged).
+-hp hugetlb  danbing-tk re-executes itself with GLIBC_TUNABLES=glibc.malloc.hugetlb=2, so malloc
+             takes its memory from reserved hugetlbfs pages of the default size (2 MB, or 1 GB with
+             default_hugepagesz=1G). Needs glibc 2.35+ and vm.nr_hugepages; otherwise malloc falls
+             back to normal pages.
+-numa        the index and graphs are copied once per NUMA node by a thread pinned to that node, so
+             first-touch allocation places the copy in local memory. Workers are pinned to the nodes
+             round robin and probe their node's copy.
+*/
+
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+
+const char HUGETLB_TUNABLE[] = "glibc.malloc.hugetlb=2";
+
+// -hp hugetlb: returns only if the tunable is already set or exec fails
+inline void execWithHugetlb(char* argv[]) {
+	const char* t = getenv("GLIBC_TUNABLES");
+	std::string v = t ? t : "";
+	if (v.find("glibc.malloc.hugetlb") != std::string::npos) { return; }
+	v = v.empty() ? HUGETLB_TUNABLE : v + ":" + HUGETLB_TUNABLE;
+	setenv("GLIBC_TUNABLES", v.c_str(), 1);
+	execv("/proc/self/exe", argv);
+	std::cerr << "[Warning] cannot re-execute with " << HUGETLB_TUNABLE << "; -hp hugetlb ignored" << std::endl;
+}
+
+// a field of /proc/self/smaps_rollup such as "AnonHugePages:" in bytes, 0 if unknown
+inline uint64_t smapsRollupBytes(const std::string& field) {
+	std::ifstream fin("/proc/self/smaps_rollup");
+	std::string key, unit;
+	uint64_t kb;
+	while (fin >> key) {
+		if (key == field and fin >> kb >> unit) { return kb * 1024; }
+		fin.ignore(1 << 16, '\n');
+	}
+	return 0;
+}
+
+// -hp thp: advises and collapses the private anonymous mappings of at least 2 MB; returns their total size
+inline uint64_t adviseHugepages() {
+	const uint64_t HPAGE = 2 << 20;
+	std::ifstream fin("/proc/self/maps");
+	std::string line;
+	uint64_t total = 0;
+	bool collapse = true;
+	while (getline(fin, line)) {
+		std::istringstream iss(line);
+		std::string range, perms, offset, dev, inode, path;
+		iss >> range >> perms >> offset >> dev >> inode >> path;
+		if (perms != "rw-p" or (path.size() and path != "[heap]")) { continue; }
+		uint64_t beg = strtoull(range.c_str(), nullptr, 16), end = strtoull(range.c_str() + range.find('-') + 1, nullptr, 16);
+		beg = (beg + HPAGE - 1) / HPAGE * HPAGE; // only whole huge pages can be backed
+		end = end / HPAGE * HPAGE;
+		if (end <= beg) { continue; }
+		if (madvise((void*)beg, end - beg, MADV_HUGEPAGE)) { continue; }
+		if (collapse and madvise((void*)beg, end - beg, MADV_COLLAPSE) and errno == EINVAL) { collapse = false; } // kernel without MADV_COLLAPSE
+		total += end - beg;
+	}
+	return total;
+}
+
+// cpus of each online NUMA node, in node order; empty if unknown
+inline std::vector<std::vector<int>> numaNodeCpus() {
+	std::vector<std::vector<int>> nodes;
+	for (int n = 0; ; ++n) {
+		std::ifstream fin("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+		if (not fin) { break; }
+		std::string list, item;
+		getline(fin, list);
+		std::vector<int> cpus;
+		std::istringstream iss(list);
+		while (getline(iss, item, ',')) { // e.g. 0-3,8-11
+			if (item.empty()) { continue; }
+			size_t dash = item.find('-');
+			int a = stoi(item.substr(0, dash)), b = dash == std::string::npos ? a : stoi(item.substr(dash + 1));
+			for (int c = a; c <= b; ++c) { cpus.push_back(c); }
+		}
+		if (cpus.size()) { nodes.push_back(cpus); } // memory-only nodes get no workers
+	}
+	return nodes;
+}
+
+// pins the calling thread
+inline bool pinToCpus(const std::vector<int>& cpus) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int c : cpus) { CPU_SET(c, &set); }
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+#endif
@@ -38,17 +38,18 @@ int main(int argc, char* argv[]) {
 	read_ikmer(args[2], gtm.n1, gtm.n_tr, ikmt);
 
 	ArrayXXd gt(gtm.n0, gtm.n1);
+	auto head = [](const ArrayXXd& m) { return m(seqN(0, std::min<Eigen::Index>(10, m.rows())), seqN(0, std::min<Eigen::Index>(10, m.cols()))); }; // top-left corner
 	fill_gt(gt, gtm.fns);
-	cout << gt(seqN(0,10),seqN(0,10)) << endl << endl;
+	cout << head(gt) << endl << endl;
 
 	norm_rd(gt, gtm.rds);
-	cout << gt(seqN(0,10),seqN(0,10)) << endl << endl;
+	cout << head(gt) << endl << endl;
 
     ArrayXXd gt1 = gt;
 	ArrayXXd Bias(gtm.n0, gtm.n_tr);
 	bias_correction(gt, ikmt, gt1, Bias);
-	cout << gt1(seqN(0,10),seqN(0,10)) << endl << endl;
-	cout << Bias(seqN(0,10),seqN(0,10)) << endl << endl;
+	cout << head(gt1) << endl << endl;
+	cout << head(Bias) << endl << endl;
 
 	Eigen::IOFormat tsv_format(Eigen::StreamPrecision, Eigen::DontAlignCols, "\t", "\n", "", "", "", "", ' ');
 	save_matrix(args[3], gt1, tsv_format);
@@ -2,6 +2,7 @@
 #define PRED_H_
 
 #include <Eigen/Core>
+#include "kmerbin.h"
 
 #include <cstdlib>
 #include <vector>
@@ -123,16 +124,33 @@ void read_ikmer(string& fn, uint64_t& n_kmer, uint64_t& n_tr, ikmer_meta& ikmt)
 	fin.close();
 }
 
+// binary *.tr.kmers (danbing-tk -kb) are mmapped; all binary inputs must come from the same RPGG
 template <typename T>
 void fill_gt(T& gt, vector<string>& fns) {
 	cout << "reading gt";
+	uint64_t rpggId = 0;
+	bool hasBinary = false;
 	for (int i0=0; i0<fns.size(); ++i0) {
+		if (isKmerBinary(fns[i0])) {
+			kmerbin_t kb(fns[i0]);
+			if (hasBinary) { assert(kb.h.rpggId == rpggId); }
+			hasBinary = true;
+			rpggId = kb.h.rpggId;
+			assert(kb.h.nkmers == gt.cols());
+			for (uint64_t i1 = 0; i1 < kb.h.nkmers; ++i1) { gt(i0,i1) = kb.count(i1); }
+			cout << "." << flush;
+			continue;
+		}
 		ifstream fin(fns[i0]);
 		assert(fin);
 		string line;
 		int i1 = 0;
 		cout << "." << flush;
-		while (getline(fin, line)) { gt(i0,i1++) = stod(line); }
+		while (getline(fin, line)) {
+			assert(i1 < gt.cols());
+			gt(i0,i1++) = stod(line);
+		}
+		assert(i1 == gt.cols());
 		fin.close();
 	}
 	cout << endl;
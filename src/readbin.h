@@ -0,0 +1,191 @@
+#ifndef READBIN_H_
+#define READBIN_H_
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <cassert>
+#include "alnbin.h"
+
+/*
+Read bins (danbing-tk -eb), a BGZF file whose uncompressed content is
+
+  header      magic "DTKRBN1\0", nloci u64, has_qual u8
+  records     one per read pair that passed kmer filtering, in input order
+
+Each record, with integers as LEB128 varints:
+
+  size        # of bytes of the rest of the record
+  locus       assigned locus
+  locus0      raw locus of countHit
+  flags       u8, READBIN_* filter flags of step 1
+  name        length, then the read name as in the input (without /1 /2)
+  read1, read2
+    bases as in alnbin.h
+  qual1, qual2
+    only if has_qual; raw quality strings, as long as the reads
+
+Sub-batches start new BGZF blocks and are indexed by locus in .reads.bin.idx, with the layout of
+.aln.bin.idx (magic "DTKRBI1\0"), so `danbing-tk -rb` can read the bins of a few loci only.
+*/
+
+const char READBIN_MAGIC[8] = { 'D', 'T', 'K', 'R', 'B', 'N', '1', '\0' };
+const char READIDX_MAGIC[8] = { 'D', 'T', 'K', 'R', 'B', 'I', '1', '\0' };
+
+enum { READBIN_KF1 = 1, READBIN_KF2 = 2, READBIN_HF1 = 4, READBIN_HF2 = 8, READBIN_RM1 = 16, READBIN_RM2 = 32 };
+
+// step 1 results of a pair that step 2 needs besides its locus
+struct readbin_pair_t {
+	uint64_t locus0;
+	uint8_t flags;
+
+	readbin_pair_t(uint64_t locus0_ = 0, uint8_t flags_ = 0) : locus0(locus0_), flags(flags_) {}
+	readbin_pair_t(uint64_t locus0_, int kf1, int kf2, int hf1, int hf2, int rm1, int rm2) : locus0(locus0_) {
+		flags = (kf1 ? READBIN_KF1 : 0) | (kf2 ? READBIN_KF2 : 0) | (hf1 ? READBIN_HF1 : 0) | (hf2 ? READBIN_HF2 : 0) |
+		        (rm1 ? READBIN_RM1 : 0) | (rm2 ? READBIN_RM2 : 0);
+	}
+};
+
+inline void encodeReadPair(std::string& out, std::string& rec, uint64_t locus, const readbin_pair_t& rp, const std::string& title,
+                           const std::string& seq1, const std::string& seq2, const std::string* qual1, const std::string* qual2) {
+	rec.clear();
+	putVarint(rec, locus);
+	putVarint(rec, rp.locus0);
+	rec += (char)rp.flags;
+	putVarint(rec, title.size());
+	rec += title;
+	encodeSeq(rec, seq1);
+	encodeSeq(rec, seq2);
+	if (qual1) {
+		rec += *qual1;
+		rec += *qual2;
+	}
+	putVarint(out, rec.size());
+	out += rec;
+}
+
+// reads the records of .reads.bin in file order, optionally only those of selected loci
+struct readbin_reader_t {
+	FILE* fp = nullptr;
+	uint64_t nloci = 0;
+	bool hasQual = false;
+	const std::vector<bool>* sel = nullptr;
+	std::vector<std::pair<uint64_t, uint64_t>> todo; // chunks to read if sel is set
+	size_t nextChunk = 0;
+	std::string buf;
+	size_t pos = 0;
+	bool done = false;
+
+	// sel: loci to keep, nullptr for all
+	readbin_reader_t(const std::string& pref, const std::vector<bool>* sel_) : sel(sel_) {
+		std::string fn = pref + ".reads.bin";
+		fp = fopen(fn.c_str(), "rb");
+		if (not fp) {
+			std::cerr << "ERROR cannot open " << fn << std::endl;
+			exit(1);
+		}
+		bgzf_read_block(fp, buf);
+		if (buf.size() != 17 or memcmp(buf.data(), READBIN_MAGIC, 8)) {
+			std::cerr << fn << " is not a danbing-tk read bin" << std::endl;
+			exit(1);
+		}
+		memcpy(&nloci, &buf[8], 8);
+		hasQual = buf[16];
+		buf.clear();
+		if (sel) {
+			chunk_index_t idx;
+			if (not idx.read(fn + ".idx", READIDX_MAGIC) or idx.nloci() != nloci) {
+				std::cerr << "ERROR cannot read the index " << fn << ".idx" << std::endl;
+				exit(1);
+			}
+			assert(sel->size() == nloci);
+			std::vector<uint32_t> ids;
+			for (uint64_t l = 0; l < nloci; ++l) {
+				if ((*sel)[l]) { ids.insert(ids.end(), idx.ids.begin() + idx.offsets[l], idx.ids.begin() + idx.offsets[l+1]); }
+			}
+			std::sort(ids.begin(), ids.end());
+			ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+			for (uint32_t i : ids) { todo.push_back(idx.chunks[i]); }
+		}
+	}
+
+	~readbin_reader_t() { if (fp) { fclose(fp); } }
+
+	readbin_reader_t(const readbin_reader_t&) = delete;
+	readbin_reader_t& operator=(const readbin_reader_t&) = delete;
+
+	// false at the end of the file or of the selected chunks
+	bool next(std::string& title, std::string& seq1, std::string& seq2, std::string& qual1, std::string& qual2, uint64_t& locus, readbin_pair_t& rp) {
+		while (true) {
+			const char* p = buf.data() + pos;
+			const char* end = buf.data() + buf.size();
+			uint64_t n = 0;
+			int s = 0;
+			bool complete = false;
+			for (; p < end; s += 7) { // record size, possibly split across blocks
+				n |= (uint64_t)(*p & 0x7f) << s;
+				if (not (*p++ & 0x80)) { complete = true; break; }
+			}
+			if (complete and end - p >= (ptrdiff_t)n) {
+				const char* recEnd = p + n;
+				pos = recEnd - buf.data();
+				locus = getVarint(p, recEnd);
+				if (sel and not (*sel)[locus]) { continue; }
+				rp.locus0 = getVarint(p, recEnd);
+				assert(p < recEnd);
+				rp.flags = *p++;
+				uint64_t len = getVarint(p, recEnd);
+				assert(p + len <= recEnd);
+				title.assign(p, len);
+				p += len;
+				decodeSeq(p, recEnd, seq1);
+				decodeSeq(p, recEnd, seq2);
+				if (hasQual) {
+					assert(p + seq1.size() + seq2.size() == recEnd);
+					qual1.assign(p, seq1.size());
+					qual2.assign(p + seq1.size(), seq2.size());
+					p = recEnd;
+				}
+				else {
+					qual1.clear();
+					qual2.clear();
+				}
+				assert(p == recEnd);
+				return true;
+			}
+			if (not fill()) {
+				if (pos != buf.size()) {
+					std::cerr << "ERROR truncated read bin" << std::endl;
+					exit(1);
+				}
+				done = true;
+				return false;
+			}
+		}
+	}
+
+	bool eof() const { return done; }
+
+private:
+	// appends the next block, or the next selected chunk
+	bool fill() {
+		buf.erase(0, pos);
+		pos = 0;
+		if (not sel) { return bgzf_read_block(fp, buf) > 0; }
+		if (nextChunk == todo.size()) { return false; }
+		auto& c = todo[nextChunk++];
+		fseeko(fp, c.first, SEEK_SET);
+		for (uint64_t nread = 0; nread < c.second; ) {
+			size_t n = bgzf_read_block(fp, buf);
+			assert(n);
+			nread += n;
+		}
+		return true;
+	}
+};
+
+#endif
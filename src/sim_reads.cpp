@@ -107,13 +107,14 @@ void sample_read_locations(int nread, std::uniform_int_distribution<int>& dis, s
 int main(int argc, char* argv[]) {
 	vector<string> args(argv, argv+argc);
 	if (argc == 1) {
-		cerr << "Usage: simreads -pe -no-err [-c] [-fs] [-rlen] [-ml] [-uni] [-bed] [-split] [-o] -i ASSEMBLY.FASTA" << endl
+		cerr << "Usage: simreads -pe -no-err [-c] [-fs] [-rlen] [-ml] [-uni] [-seed] [-bed] [-split] [-o] -i ASSEMBLY.FASTA" << endl
 		     << "  Options:" << endl
 		     << "  -c INT     Simulate reads from each seqeunce at THIS coverage. [15]" << endl
 		     << "  -fs INT    Fragment size. [500]" << endl
 		     << "  -rlen INT  Read length. [150]" << endl
 		     << "  -ml INT    Contigs shorter than MIN_CTG_LEN are ignored. [50000]" << endl
 			 << "  -uni       Sample read position from a uniform distribution" << endl
+			 << "  -seed INT  Seed for -uni, for reproducible datasets. [random]" << endl
 			 << "  -bed       Output in bed format as chr, start, end, read1, read2" << endl
 			 << "  -split     split output by chromosome/contig. Requires -o"  << endl
 			 << "  -o STR     output prefix" << endl
@@ -127,6 +128,8 @@ int main(int argc, char* argv[]) {
 	bool split = false;
 	bool bed = false;
 	size_t cv = 15;
+	bool seeded = false;
+	size_t seed = 0;
 	string ifname;
 	string ofname = "";
 	for (size_t argi = 1; argi < argc; ++argi) {
@@ -138,6 +141,7 @@ int main(int argc, char* argv[]) {
 		else if (args[argi] == "-rlen") { RLEN = stoul(args[++argi]); }
 		else if (args[argi] == "-ml") { MIN_CTG_LEN = stoul(args[++argi]); }
 		else if (args[argi] == "-uni") { uni = true; }
+		else if (args[argi] == "-seed") { seeded = true; seed = stoul(args[++argi]); }
 		else if (args[argi] == "-bed") { bed = true; }
 		else if (args[argi] == "-split") { split = true; }
 		else if (args[argi] == "-o") { ofname = args[++argi]; }
@@ -146,7 +150,7 @@ int main(int argc, char* argv[]) {
 	NBEG = FLEN - RLEN;
 	SHFT = 2*RLEN/cv;
 	std::random_device randdevice;  // Obtain a seed from the operating system
-	std::mt19937 generator(randdevice()); // Standard Mersenne Twister engine
+	std::mt19937 generator(seeded ? seed : randdevice()); // Standard Mersenne Twister engine
 
 	// fragment length = 500 = 150 forward strand + 200 gap + 150 reverse strand
 	if (pe) {
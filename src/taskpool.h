@@ -0,0 +1,120 @@
+#ifndef TASKPOOL_H_
+#define TASKPOOL_H_
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+/*
+Work-stealing task pool.
+
+Each worker owns a deque. A worker takes tasks from the front of its own deque and,
+when that is empty, steals from the back of the other workers' deques. When no task
+can be found, the worker calls `refill`, which may push new tasks (e.g. read the next
+batch of reads), report that it has nothing to do right now, or report that no more
+tasks will ever come. The pool returns once refill has reported REFILL_DONE and every
+queued or running task has finished. Tasks may push further tasks.
+
+No process-global or named objects are used; everything lives in the pool instance.
+*/
+class task_pool_t {
+public:
+	typedef std::function<void(int)> task_t; // argument: worker id
+	enum { REFILL_PUSHED, REFILL_BUSY, REFILL_DONE };
+
+	task_pool_t(int nworker_) : nworker(nworker_ > 0 ? nworker_ : 1), dqs(nworker) {}
+
+	int size() { return nworker; }
+
+	void push(int wid, task_t t) {
+		deque_t& dq = dqs[wid % nworker];
+		{
+			std::lock_guard<std::mutex> lk(dq.m);
+			dq.q.push_back(std::move(t));
+			++nqueued;
+		}
+		wake();
+	}
+
+	// wake idle workers, e.g. after resources that limit refill() were released
+	void wake() {
+		{
+			std::lock_guard<std::mutex> lk(m);
+			++epoch;
+		}
+		cv.notify_all();
+	}
+
+	void run(std::function<int(int)> refill) {
+		done = false;
+		std::vector<std::thread> ts;
+		for (int i = 0; i < nworker; ++i) { ts.emplace_back(&task_pool_t::work, this, i, refill); }
+		for (auto& t : ts) { t.join(); }
+	}
+
+	uint64_t nStolen() { return nsteal; }
+
+private:
+	struct deque_t {
+		std::mutex m;
+		std::deque<task_t> q;
+	};
+
+	int nworker;
+	std::vector<deque_t> dqs;
+	std::atomic<uint64_t> nqueued{0}, nrunning{0}, nsteal{0};
+	std::mutex m;
+	std::condition_variable cv;
+	uint64_t epoch = 0;
+	bool done = false;
+
+	bool pop(int wid, task_t& t) {
+		for (int i = 0; i < nworker; ++i) {
+			deque_t& dq = dqs[(wid + i) % nworker];
+			std::lock_guard<std::mutex> lk(dq.m);
+			if (dq.q.empty()) { continue; }
+			if (i == 0) { t = std::move(dq.q.front()); dq.q.pop_front(); }
+			else        { t = std::move(dq.q.back());  dq.q.pop_back(); ++nsteal; }
+			++nrunning; // incremented before nqueued drops so that an idle worker never sees both at 0
+			--nqueued;
+			return true;
+		}
+		return false;
+	}
+
+	void work(int wid, std::function<int(int)> refill) {
+		while (true) {
+			uint64_t e;
+			{
+				std::lock_guard<std::mutex> lk(m);
+				if (done) { return; }
+				e = epoch;
+			}
+			task_t t;
+			if (pop(wid, t)) {
+				t(wid);
+				--nrunning;
+				wake();
+				continue;
+			}
+			int r = refill(wid);
+			if (r == REFILL_PUSHED) { continue; }
+			if (r == REFILL_DONE and nqueued == 0 and nrunning == 0) {
+				{
+					std::lock_guard<std::mutex> lk(m);
+					done = true;
+				}
+				cv.notify_all();
+				return;
+			}
+			std::unique_lock<std::mutex> lk(m);
+			cv.wait(lk, [&]{ return done or epoch != e; });
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,76 @@
+#!/usr/bin/env bash
+# Checks that danbing-tk-pred computes the same bias-corrected genotypes and bias from text and
+# binary (-kb) .tr.kmers, including a cohort mixing both (exit 1 otherwise). Two samples are
+# simulated with a fixed seed from test/QC/input/HG002.*.fa and hs1.*.fa, the genomes of
+# test/QC/input/pan, and every 4th kmer of each locus is taken as invariant.
+#
+# usage: test/pred_kb.sh [-c COVERAGE] [-o OUT_DIR]
+#   defaults: -c 200 -o pred_kb_out
+set -eu
+
+cd "$(dirname "$0")/.."
+cov=200
+od=pred_kb_out
+rpgg=test/QC/input/pan
+while getopts "c:o:" opt; do
+	case $opt in
+		c) cov=$OPTARG ;;
+		o) od=$OPTARG ;;
+		*) sed -n 7,8p "$0"; exit 1 ;;
+	esac
+done
+
+make bin/danbing-tk bin/danbing-tk-pred bin/sim_reads
+mkdir -p $od
+
+for g in HG002 hs1; do
+	reads=$od/$g.reads.fa
+	: >$reads
+	for h in 0 1; do
+		bin/sim_reads -pe -no-err -uni -seed 1 -c $cov -ml 0 -o $od/$g.$h -i test/QC/input/$g.$h.fa 2>/dev/null
+		cat $od/$g.$h.allctgs.reads.fa >>$reads
+		rm $od/$g.$h.allctgs.reads.fa
+	done
+	bin/danbing-tk -gc 50 3 -ae -kf 4 1 -cth 10 -k 21 -qs $rpgg -fa $reads -p 2 -o $od/$g.txt >/dev/null 2>$od/$g.txt.log
+	bin/danbing-tk -gc 50 3 -ae -kf 4 1 -cth 10 -k 21 -qs $rpgg -fa $reads -p 2 -kb -o $od/$g.bin >/dev/null 2>$od/$g.bin.log
+done
+if ! awk '$1 > 0 { found = 1; exit } END { exit !found }' $od/HG002.txt.tr.kmers; then
+	echo "ERROR: all counts are 0 in $od/HG002.txt.tr.kmers" >&2
+	exit 1
+fi
+
+# invariant kmers in the layout read by read_ikmer (src/pred.h), indexed by .tr.kmers row
+python3 - $rpgg.tr.kmers $od/pan.ikmers <<'PY'
+import struct, sys
+nk = []
+for line in open(sys.argv[1]):
+    if line[0] == ">": nk.append(0)
+    else: nk[-1] += 1
+iks, cnk, cnik, n = [], [], [], 0
+for m in nk:
+    iks += [(n + i, 2) for i in range(0, m, 4)]
+    n += m
+    cnk.append(n)
+    cnik.append(len(iks))
+with open(sys.argv[2], "wb") as f:
+    f.write(struct.pack("<QQQ", n, len(iks), len(nk)))
+    f.write(struct.pack("<%dI" % len(nk), *cnk))
+    f.write(struct.pack("<%dI" % len(nk), *cnik))
+    for ki, kc in iks: f.write(struct.pack("<IB", ki, kc))
+PY
+
+status=0
+for c in txt.txt bin.bin txt.bin; do
+	printf "%s\t30\n%s\t30\n" $od/HG002.${c%.*}.tr.kmers $od/hs1.${c#*.}.tr.kmers >$od/$c.meta
+	bin/danbing-tk-pred $od/$c.meta $od/pan.ikmers $od/$c.gt1 $od/$c.bias >$od/$c.log
+	if [[ $c != txt.txt ]]; then
+		for x in gt1 bias; do
+			if ! cmp -s $od/txt.txt.$x $od/$c.$x; then
+				echo "ERROR: $od/$c.$x differs from $od/txt.txt.$x" >&2
+				status=1
+			fi
+		done
+	fi
+done
+[[ $status == 0 ]] && echo "danbing-tk-pred outputs identical for text, binary and mixed .tr.kmers" >&2
+exit $status